@@ -1,22 +1,160 @@
 #include <assert.h>
+#include <errno.h>
 #include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdio.h>
 #include <dirent.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
-#include <math.h>
 
 #include "allocator.h"
 #include "numa.h"
+#include "pagemap.h"
 #include "util.h"
 
 numa_heap **numa_heaps;
-static size_t current_node = 0U;
-void ***free_lists_starting_addr;
-free_block *last;
-size_t size_of_heap;
+static size_t nodes_num;
+
+// Node the calling thread's next interleaved object goes to
+static __thread size_t interleave_cursor;
+
+/*
+ * Every thread keeps a small stack of free blocks per bin for its home node, so the
+ * common allocate/deallocate pair never touches numa_heap::lock. Blocks move between
+ * a thread cache and the shared heap tcache_batch() at a time, which is TCACHE_BATCH
+ * blocks for small bins and less for big ones so a few threads cannot drain a bin.
+ */
+#define TCACHE_BATCH 32
+#define TCACHE_BATCH_BYTES (64 * 1024)
+
+static inline size_t tcache_batch(size_t bin_index) {
+    size_t batch = TCACHE_BATCH_BYTES / bin_size(bin_index);
+    if (batch > TCACHE_BATCH) return TCACHE_BATCH;
+    return batch > 0 ? batch : 1;
+}
+
+typedef struct {
+    free_block *head;
+    size_t count;
+} tcache_bin;
+
+/*
+ * Thread-local free list of an object cache. The first OBJECT_CACHE_MAGAZINES caches
+ * get one in every thread cache, generation tells whether it still belongs to the
+ * cache in its slot or to one destroyed since.
+ */
+#define OBJECT_CACHE_MAGAZINES 16
+
+typedef struct {
+    unsigned long generation;
+    void *head;
+    size_t count;
+} object_magazine;
+
+typedef struct thread_cache {
+    int node; // home node of the cached blocks, -1 while the cache is unbound
+    int exited; // set by the key destructor, the thread bypasses its cache from then on
+    tcache_bin bins[BINS];
+    object_magazine magazines[OBJECT_CACHE_MAGAZINES];
+
+    // The thread's allocation counters, see thread_count()
+    size_t *counts;
+    struct thread_cache *next;
+    struct thread_cache *prev;
+} thread_cache;
+
+/*
+ * Allocations and frees are counted per thread, so counting never shares a cache line,
+ * and summed up by get_allocator_stats(). counts[(node * COUNT_ROWS + row) * COUNT_KINDS
+ * + kind] is only written by its thread, the rows being the bins and CACHE_ROW for all
+ * object caches. Live threads are on registered_caches, threads that exited leave their
+ * counts in retired_counts.
+ */
+enum { COUNT_ALLOCS, COUNT_FREES, COUNT_REMOTE_FREES, COUNT_KINDS };
+#define CACHE_ROW BINS
+#define COUNT_ROWS (BINS + 1)
+
+typedef struct {
+    pthread_mutex_t lock;
+    span *slabs; // slabs with objects left to hand out
+    span *full;
+} __attribute__((aligned(CACHE_LINE_SIZE))) object_cache_node;
+
+/*
+ * Objects sit `stride` bytes apart from the start of a slab, which keeps every one of
+ * them aligned. Free objects are linked through the word at link_offset, which is past
+ * the object when a ctor has to find it intact again.
+ */
+struct object_cache {
+    size_t size;
+    size_t stride;
+    size_t link_offset;
+    size_t slab_size;
+    size_t batch; // objects moved between a magazine and the slabs at a time
+    object_hook ctor;
+    object_hook dtor;
+    void *arg;
+    int magazine; // slot in the thread caches, -1 without one
+    unsigned long generation;
+    size_t nodes;
+    size_t map_size;
+    struct object_cache *next;
+    object_cache_node *node;
+};
+
+/*
+ * Large objects are node bound page runs mapped on their own. Freed runs stay cached
+ * on their node, up to LARGE_CACHE_BYTES, and are reused by later allocations that
+ * fit in them without wasting more than half of the run.
+ */
+#define LARGE_CACHE_BYTES (64UL * 1024 * 1024)
+
+/*
+ * Bins carve blocks out of spans of at least SPAN_MIN_SIZE that hold at least
+ * SPAN_MIN_BLOCKS blocks.
+ */
+#define SPAN_MIN_SIZE (64 * 1024)
+#define SPAN_MIN_BLOCKS 8
+
+/*
+ * A heap looks for memory to purge at most twice per decay period, on its slow paths,
+ * so the clock is read there and never on the thread cache fast path.
+ */
+#define PURGE_PASSES_PER_DECAY 2
+
+// From <linux/mman.h> 5.14, older headers lack it
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+static allocator_config alloc_config;
+static size_t system_page_size;
+static span *span_pool;
+static pthread_mutex_t span_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread thread_cache tcache = { .node = -1 };
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static thread_cache *registered_caches;
+static size_t *retired_counts;
+static size_t counts_size;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static object_cache *object_caches[OBJECT_CACHE_MAGAZINES]; // caches owning a magazine slot
+static object_cache *live_caches;
+static unsigned long cache_generations;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static sem_t stats_wakeup;
+static pthread_t stats_thread;
+static int stats_thread_running;
+static int stats_stop;
+static struct sigaction stats_old_action;
 
 void *mem_alloc(size_t size) {
     void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
@@ -46,7 +184,7 @@ void restore_thread_affinity(void) {
     CPU_ZERO(&cpu_set); // Start with an empty CPU set
 
     // Add all available CPUs to the set
-    for (size_t cpu = 0U; cpu < (size_t) sysconf(_SC_NPROCESSORS_CONF); cpu++) {
+    for (size_t cpu = 0U; cpu < current_topology->cpus_num && cpu < CPU_SETSIZE; cpu++) {
         CPU_SET(cpu, &cpu_set);
     }
 
@@ -59,7 +197,7 @@ void restore_thread_affinity(void) {
 
 /*
  * Thread affinity must be set to a specified cpu in order to be able to allocate memory on it
- * so this function creates a set and based on the cpu_on_node array it puts them into the corret
+ * so this function creates a set and based on the topology's cpu_on_node map it puts them into the corret
  * node set.
  */ 
 void set_thread_affinity(int node) {
@@ -67,8 +205,8 @@ void set_thread_affinity(int node) {
     CPU_ZERO(&cpu_set);  // create empty cpu set
 
     //  add CPUs that belond to the specified NUMA node to the cpu set
-    for (size_t cpu = 0U; cpu < (size_t) sysconf(_SC_NPROCESSORS_CONF); cpu++) {
-        if (cpu_on_node[cpu] == node) CPU_SET(cpu, &cpu_set);
+    for (size_t cpu = 0U; cpu < current_topology->cpus_num && cpu < CPU_SETSIZE; cpu++) {
+        if (current_topology->cpu_on_node[cpu] == node) CPU_SET(cpu, &cpu_set);
     }
 
     // restrict the thread to the CPU in the target NUMA node
@@ -82,7 +220,7 @@ void set_thread_affinity(int node) {
  * memory allocation starts off as vitrual memory and this function it 
  * iterates through the memory to enforce physical allocation
  * *page = 0; triggers a page fault which causes the OS to allocate a 
- * physical page of memory on the NUMA node that the thread is bound to.
+ * physical page of memory on the NUMA node the range is bound to by bind_memory().
  */
 void touch_memory(void *ptr, size_t size) {
     size_t page_size = sysconf(_SC_PAGESIZE);
@@ -94,359 +232,2385 @@ void touch_memory(void *ptr, size_t size) {
     }
 }
 
-void initialize_free_lists(numa_heap **heap_addr, int node) {
-    numa_heap *heap = *heap_addr;
-    size_t bin_capacity = heap->heap_size / BINS; // Divide heap into bin-sized chunks
-    size_t current_offset = 0;
-    for (size_t index = 0U; index < BINS; index++){
-	long bin_size = 16 * pow(2, index);
-        bin_capacity = heap->heap_size / BINS;
+/*
+ * Faults the range in with a single madvise on kernels that have MADV_POPULATE_WRITE
+ * (5.14 on), which skips a trap per page, and with touch_memory() elsewhere.
+ */
+static void populate_memory(void *ptr, size_t size) {
+    static int populate_unsupported;
+
+    if (!__atomic_load_n(&populate_unsupported, __ATOMIC_RELAXED)) {
+        if (madvise(ptr, size, MADV_POPULATE_WRITE) == 0) return;
+        if (errno == EINVAL) __atomic_store_n(&populate_unsupported, 1, __ATOMIC_RELAXED);
+    }
 
-    	if (index == BINS - 1) {
-            bin_capacity = heap->heap_size - current_offset;
-        }
+    touch_memory(ptr, size);
+}
 
-        size_t remaining = bin_capacity;
- 
-        while (remaining >= (long unsigned int) bin_size) {
-	    free_block *new_block = (free_block *) mem_alloc(sizeof(free_block));
-            new_block->starting_addr = (free_block *)((char *)heap->start_addr + current_offset);
-            new_block->size = bin_size;
-	    new_block->next = NULL;
+/*
+ * Span descriptors are carved a page at a time and recycled through span_pool, large
+ * objects take and return one with every run.
+ */
+static span *span_alloc(void) {
+    pthread_mutex_lock(&span_pool_lock);
 
-	    if (heap->free_list[index] == NULL) { 
-	        heap->free_list[index] = new_block;
-		last = new_block;
-	    } else {
-		last->next = (struct free_block *) new_block;
-		last = new_block;
-	    }
+    if (span_pool == NULL) {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        span *page = (span *) mem_alloc(page_size);
+
+        if (page == NULL) {
+            pthread_mutex_unlock(&span_pool_lock);
+            return NULL;
+        }
 
-            current_offset += bin_size;
-            remaining -= bin_size;
+        for (size_t i = 0U; i < page_size / sizeof(span); i++) {
+            page[i].next = span_pool;
+            span_pool = &page[i];
         }
-	if (heap->free_list[index])
-	    free_lists_starting_addr[node][index] = heap->free_list[index]->starting_addr;
     }
 
+    span *result = span_pool;
+    span_pool = result->next;
+    pthread_mutex_unlock(&span_pool_lock);
+
+    result->next = NULL;
+    return result;
 }
 
-void init_allocator(size_t heap_size) {
-    assert(heap_size > 0);
-    parse_cpus_to_node();
-    size_t nodes =  get_numa_nodes_num();
-    size_t size = nodes * sizeof(struct numa_heap *);
+static void span_release(span *descriptor) {
+    pthread_mutex_lock(&span_pool_lock);
+    descriptor->next = span_pool;
+    span_pool = descriptor;
+    pthread_mutex_unlock(&span_pool_lock);
+}
 
-    numa_heaps = (numa_heap **) mem_alloc(size);
-    free_lists_starting_addr = (void ***) mem_alloc(sizeof(void ***));
-    size_of_heap = heap_size;
+/*
+ * Lock wrappers that count acquisitions for get_allocator_stats(), a failed trylock is
+ * a contended acquisition. The counters are only touched with the lock held.
+ */
+static inline void bin_lock(numa_heap *heap, size_t bin_index) {
+    heap_bin *bin = &heap->bins[bin_index];
+    int contended = pthread_mutex_trylock(&bin->lock) != 0;
 
-    for (size_t i = 0U; i < nodes; i++) {
-	numa_heaps[i] = (numa_heap *) mem_alloc(sizeof(numa_heap));
-	free_lists_starting_addr[i] = (void **) mem_alloc(sizeof(void **));
+    if (contended) pthread_mutex_lock(&bin->lock);
+    bin->lock_acquisitions++;
+    bin->contended_acquisitions += contended;
+}
 
-	set_thread_affinity(i);
+static inline void heap_lock(numa_heap *heap) {
+    int contended = pthread_mutex_trylock(&heap->lock) != 0;
 
-	numa_heaps[i]->start_addr = mem_alloc(heap_size);
-	touch_memory(numa_heaps[i]->start_addr, heap_size);
+    if (contended) pthread_mutex_lock(&heap->lock);
+    heap->lock_acquisitions++;
+    heap->contended_acquisitions += contended;
+}
 
-	numa_heaps[i]->heap_size = heap_size;
-	numa_heaps[i]->numa_node = i;
+static size_t *tcache_register_counts(void) {
+    if (counts_size == 0 || tcache.exited) return NULL;
 
-	for (size_t bin = 0U; bin < BINS; bin++) {
-	   numa_heaps[i]->free_list[bin] = NULL;
-	}
+    size_t *counts = (size_t *) mem_alloc(counts_size);
+    if (counts == NULL) return NULL;
 
-        initialize_free_lists(&numa_heaps[i], i);
-	
-	if (pthread_mutex_init(&numa_heaps[i]->lock, NULL) != 0) {
-            fprintf(stderr, "Failed to initialize mutex for NUMA heap %zu\n", i);
+    pthread_mutex_lock(&stats_lock);
+    tcache.counts = counts;
+    tcache.prev = NULL;
+    tcache.next = registered_caches;
+    if (registered_caches != NULL) registered_caches->prev = &tcache;
+    registered_caches = &tcache;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(tcache_key, &tcache);
+    return counts;
+}
+
+/*
+ * Counts for a thread past its exit destructor, its counters are retired already and
+ * registering them again would leave its dead thread-local cache on the list.
+ */
+static void retired_count(size_t index, size_t n) {
+    pthread_mutex_lock(&stats_lock);
+    if (retired_counts != NULL) retired_counts[index] += n;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Adds `n` to one of the calling thread's counters. Only this thread writes them, the
+ * relaxed store just keeps concurrent readers from seeing a torn value.
+ */
+static inline void thread_count(unsigned node, size_t bin_index, size_t kind, size_t n) {
+    size_t index = (node * COUNT_ROWS + bin_index) * COUNT_KINDS + kind;
+    size_t *counts = tcache.counts;
+
+    if (counts == NULL) {
+        if (tcache.exited) {
+            retired_count(index, n);
             return;
         }
+        if ((counts = tcache_register_counts()) == NULL) return;
+    }
+
+    __atomic_store_n(&counts[index], counts[index] + n, __ATOMIC_RELAXED);
+}
+
+static unsigned long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    return (unsigned long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-        // printf("Initialized NUMA heap for node %zu in address %p with size %zu bytes in cpu %d\n", i, numa_heaps[i]->start_addr, heap_size, sched_getcpu());
+/*
+ * Commits the next `size` bytes of the heap's reservation. The reservation is bound to
+ * the heap's node, so the pages land there whenever they get faulted in, which is right
+ * away only in prefault mode.
+ */
+static int heap_commit(numa_heap *heap, size_t size) {
+    if (heap->heap_size + size > heap->reserved_size) return -1;
+
+    char *start = (char *)heap->start_addr + heap->heap_size;
+
+    if (mprotect(start, size, PROT_READ | PROT_WRITE) < 0) {
+        fprintf(stderr, "mprotect failed\n");
+        return -1;
     }
 
-    restore_thread_affinity();
+    if (alloc_config.prefault) {
+        populate_memory(start, size);
+        if (heap->tail_purged == 0) heap->tail_resident += size;
+    }
+    heap->heap_size += size;
+
+    return 0;
 }
 
-void *allocate_localy(size_t size) {
-    assert(size > 0);
+static inline size_t bin_span_size(size_t bin_index) {
+    size_t size = SPAN_MIN_BLOCKS * bin_size(bin_index);
+    return size > SPAN_MIN_SIZE ? size : SPAN_MIN_SIZE;
+}
 
-    int cpu = sched_getcpu();
-    if (cpu == -1) return NULL;
-    
-    int node = cpu_on_node[cpu];
-    if (node == -1) return NULL;
+static inline size_t free_span_list(size_t size) {
+    size_t pages = size / system_page_size;
+    return pages < FREE_SPAN_LISTS ? pages : FREE_SPAN_LISTS - 1;
+}
 
-    set_thread_affinity(node);
+static inline int span_is_full(const span *s) {
+    return s->free_list == NULL && s->bump_ptr == (char *) s->start + s->size;
+}
 
-    numa_heap *heap = numa_heaps[node];
-    if (!heap) {
-        restore_thread_affinity();
-        return NULL;
+static void span_list_push(span **list, span *s) {
+    s->prev = NULL;
+    s->next = *list;
+    if (*list != NULL) (*list)->prev = s;
+    *list = s;
+}
+
+static void span_list_remove(span **list, span *s) {
+    if (s->prev != NULL) s->prev->next = s->next;
+    else *list = s->next;
+    if (s->next != NULL) s->next->prev = s->prev;
+
+    s->next = NULL;
+    s->prev = NULL;
+}
+
+/*
+ * Files a free run under its size. Only its first and last page are pointed at it in
+ * the page map, that is all coalescing needs to find it from either neighbour.
+ */
+static void heap_insert_free_span(numa_heap *heap, span *run) {
+    run->bin = FREE_BIN;
+    pagemap_set(run->start, system_page_size, run);
+    pagemap_set((char *) run->start + run->size - system_page_size, system_page_size, run);
+    span_list_push(&heap->free_spans[free_span_list(run->size)], run);
+}
+
+/*
+ * Takes a run of `size` bytes out of the heap. The smallest free run that fits, or the
+ * lowest one under address_ordered_first_fit, is split when it is bigger than needed,
+ * and the heap is carved further, committing more of the reservation, when no free run
+ * fits. The caller must hold heap->lock and register the run in the page map.
+ */
+static span *heap_alloc_pages(numa_heap *heap, size_t size) {
+    span *found = NULL;
+
+    if (heap->policy == address_ordered_first_fit) {
+        for (size_t i = free_span_list(size); i < FREE_SPAN_LISTS; i++) {
+            for (span *run = heap->free_spans[i]; run != NULL; run = run->next) {
+                if (run->size >= size && (found == NULL || run->start < found->start)) found = run;
+            }
+        }
     }
 
-    pthread_mutex_lock(&heap->lock);
+    for (size_t i = free_span_list(size); i < FREE_SPAN_LISTS - 1 && found == NULL; i++) {
+        found = heap->free_spans[i];
+    }
 
-    size_t bin_index = get_bin_index(size);
+    if (found == NULL) {
+        for (span *run = heap->free_spans[FREE_SPAN_LISTS - 1]; run != NULL; run = run->next) {
+            if (run->size >= size && (found == NULL || run->size < found->size)) found = run;
+        }
+    }
 
-    if (bin_index >= BINS) {
-        pthread_mutex_unlock(&heap->lock);
-        restore_thread_affinity();
-        return NULL;
+    if (found != NULL) {
+        span_list_remove(&heap->free_spans[free_span_list(found->size)], found);
+        if (found->purged) heap->purged_bytes -= found->size;
+
+        // Without a descriptor for the rest the whole run is handed out
+        span *rest = found->size > size ? span_alloc() : NULL;
+        if (rest != NULL) {
+            rest->start = (char *) found->start + size;
+            rest->size = found->size - size;
+            rest->node = heap->numa_node;
+            rest->purged = found->purged;
+            rest->freed_at = found->freed_at;
+            if (rest->purged) heap->purged_bytes += rest->size;
+            found->size = size;
+            heap_insert_free_span(heap, rest);
+        }
+
+        found->purged = 0;
+        return found;
     }
 
-    free_block *ptr = heap->free_list[bin_index];
-    free_block *prev = NULL;
+    if (heap->used_size + size > heap->reserved_size) return NULL;
 
-    while (ptr != NULL) {
-      if (!ptr) break;
+    while (heap->used_size + size > heap->heap_size) {
+        if (heap_commit(heap, alloc_config.chunk_size) != 0) return NULL;
+    }
 
-      if (ptr->size >= size) {
-        void *temp = ptr->starting_addr;
-        if (prev != NULL) prev->next = ptr->next;
-        else heap->free_list[bin_index] = (free_block *) ptr->next;
+    span *fresh = span_alloc();
+    if (fresh == NULL) return NULL;
 
-        restore_thread_affinity();
-        pthread_mutex_unlock(&heap->lock);
-        return temp;
-      }
-  
-      prev = ptr;
-      ptr = (free_block *) ptr->next;
+    fresh->start = (char *) heap->start_addr + heap->used_size;
+    fresh->size = size;
+    fresh->node = heap->numa_node;
+    fresh->purged = 0;
+    heap->used_size += size;
+
+    // Past the frontier come resident pages, then purged ones, then never touched ones
+    size_t resident = size < heap->tail_resident ? size : heap->tail_resident;
+    heap->tail_resident -= resident;
+    size_t purged = size - resident < heap->tail_purged ? size - resident : heap->tail_purged;
+    heap->tail_purged -= purged;
+
+    return fresh;
+}
+
+/*
+ * Gives a run back to the heap, merged with the free runs right before and after it. A
+ * run that ends where the carved part of the heap ends melts back into the uncarved
+ * rest. The caller must hold heap->lock.
+ */
+static void heap_free_pages(numa_heap *heap, span *run) {
+    char *heap_start = (char *) heap->start_addr;
+
+    if ((char *) run->start > heap_start) {
+        span *before = pagemap_lookup((char *) run->start - system_page_size);
+
+        if (before != NULL && before->bin == FREE_BIN) {
+            span_list_remove(&heap->free_spans[free_span_list(before->size)], before);
+            if (before->purged) heap->purged_bytes -= before->size;
+            before->size += run->size;
+            span_release(run);
+            run = before;
+        }
     }
 
-    pthread_mutex_unlock(&heap->lock);
-    restore_thread_affinity();
-    return NULL;
+    char *end = (char *) run->start + run->size;
+    char *frontier = heap_start + heap->used_size;
+
+    if (end < frontier) {
+        span *after = pagemap_lookup(end);
+
+        if (after != NULL && after->bin == FREE_BIN) {
+            span_list_remove(&heap->free_spans[free_span_list(after->size)], after);
+            if (after->purged) heap->purged_bytes -= after->size;
+            run->size += after->size;
+            end += after->size;
+            span_release(after);
+        }
+    }
+
+    // Purged neighbours merge in as resident, the next purge covers them again
+    unsigned long now = now_ms();
+
+    if (end == frontier) {
+        heap->used_size -= run->size;
+        heap->tail_resident += run->size;
+        heap->tail_freed_at = now;
+        span_release(run);
+        return;
+    }
+
+    run->purged = 0;
+    run->freed_at = now;
+    heap_insert_free_span(heap, run);
 }
 
-void *allocate_interleaved(size_t size) {
-    assert(size > 0);
+/*
+ * Gives the pages of a free range back to the OS. The range keeps its mapping and its
+ * mbind policy, so pages faulted in again later are placed on the heap's node again.
+ */
+static int heap_purge_range(numa_heap *heap, void *start, size_t size) {
+    int advice = alloc_config.purge_lazy ? MADV_FREE : MADV_DONTNEED;
 
-    size_t nodes = get_numa_nodes_num();
-    size_t node = 0U;
+    if (madvise(start, size, advice) < 0) return -1;
 
-    for (size_t i = 0U; i < nodes; i++) {
-        node = (current_node + i) % nodes;
+    heap->purges++;
+    return 0;
+}
+
+static int idle_for(unsigned long freed_at, unsigned long now, unsigned long decay) {
+    return now - freed_at >= decay;
+}
+
+/*
+ * Purges free spans, the resident part past the frontier and cached large runs that
+ * stayed free for at least `decay` ms. The caller must hold heap->lock.
+ */
+static void heap_purge(numa_heap *heap, unsigned long now, unsigned long decay) {
+    __atomic_store_n(&heap->last_purge, now, __ATOMIC_RELAXED);
+
+    for (size_t list = 0U; list < FREE_SPAN_LISTS; list++) {
+        for (span *run = heap->free_spans[list]; run != NULL; run = run->next) {
+            if (run->purged || !idle_for(run->freed_at, now, decay)) continue;
+            if (heap_purge_range(heap, run->start, run->size) != 0) continue;
+
+            run->purged = 1;
+            heap->purged_bytes += run->size;
+        }
     }
 
-    set_thread_affinity(node);
+    if (heap->tail_resident > 0 && idle_for(heap->tail_freed_at, now, decay)) {
+        char *frontier = (char *) heap->start_addr + heap->used_size;
 
-    numa_heap *heap = numa_heaps[node];
-    if (!heap) {
-        restore_thread_affinity();
-        return NULL;
+        if (heap_purge_range(heap, frontier, heap->tail_resident) == 0) {
+            heap->tail_purged += heap->tail_resident;
+            heap->tail_resident = 0U;
+        }
     }
 
-    pthread_mutex_lock(&heap->lock);
+    for (span *run = heap->large_cache; run != NULL; run = run->next) {
+        if (run->purged || !idle_for(run->freed_at, now, decay)) continue;
+        if (heap_purge_range(heap, run->start, run->size) != 0) continue;
 
-    size_t bin_index = get_bin_index(size);
+        run->purged = 1;
+        heap->purged_bytes += run->size;
+    }
+}
 
-    if (bin_index >= BINS) {
+/*
+ * Called on the slow paths without heap->lock, runs a purge pass when the last one is
+ * long enough ago. The check is made before locking so most calls stay lock free.
+ */
+static void heap_maybe_purge(numa_heap *heap) {
+    if (alloc_config.purge_decay_ms < 0) return;
+
+    unsigned long decay = (unsigned long) alloc_config.purge_decay_ms;
+    unsigned long now = now_ms();
+
+    if (now - __atomic_load_n(&heap->last_purge, __ATOMIC_RELAXED) < decay / PURGE_PASSES_PER_DECAY) return;
+
+    heap_lock(heap);
+    if (now - heap->last_purge >= decay / PURGE_PASSES_PER_DECAY) heap_purge(heap, now, decay);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/*
+ * Gives a bin a fresh span to hand blocks out of. The caller must hold the bin's lock,
+ * the pages come from the page heap under heap->lock. The span is registered in the page
+ * map before that lock is dropped, so coalescing neighbours never see stale entries.
+ */
+static span *heap_new_bin_span(numa_heap *heap, size_t bin_index) {
+    heap_lock(heap);
+
+    span *fresh = heap_alloc_pages(heap, bin_span_size(bin_index));
+    if (fresh == NULL) {
         pthread_mutex_unlock(&heap->lock);
-        restore_thread_affinity();
         return NULL;
     }
 
-    free_block *ptr = heap->free_list[bin_index];
-    free_block *prev = NULL;
+    fresh->bin = bin_index;
+    fresh->interleaved = 0;
+    fresh->free_list = NULL;
+    fresh->bump_ptr = fresh->start;
+    fresh->used = 0U;
 
-    while (ptr != NULL) {
-        if (!ptr) break;
+    if (pagemap_set(fresh->start, fresh->size, fresh) != 0) {
+        heap_free_pages(heap, fresh);
+        pthread_mutex_unlock(&heap->lock);
+        return NULL;
+    }
 
-	if (ptr->size >= size) {
-	    void *temp = ptr->starting_addr;
-	    if (prev != NULL) prev->next = ptr->next;
-	    else heap->free_list[bin_index] = (free_block *) ptr->next;
+    heap->bin_span_bytes += fresh->size;
+    pthread_mutex_unlock(&heap->lock);
 
-            restore_thread_affinity();
-            pthread_mutex_unlock(&heap->lock);
-            return temp;
-	}
-    
-    	prev = ptr;
-	ptr = (free_block *) ptr->next;
+    span_list_push(&heap->bins[bin_index].spans, fresh);
+    return fresh;
+}
+
+/*
+ * The span of the bin the heap's policy hands blocks out of next, NULL when none has
+ * room. Only refills get here, so walking the bin's spans stays off the fast path.
+ */
+static span *bin_pick_span(numa_heap *heap, size_t bin_index) {
+    span *pick = heap->bins[bin_index].spans;
+    if (pick == NULL) return NULL;
+
+    switch (heap->policy) {
+        case best_fit_within_a_bin:
+            for (span *candidate = pick->next; candidate != NULL; candidate = candidate->next) {
+                if (candidate->used > pick->used) pick = candidate;
+            }
+            break;
+        case address_ordered_first_fit:
+            for (span *candidate = pick->next; candidate != NULL; candidate = candidate->next) {
+                if (candidate->start < pick->start) pick = candidate;
+            }
+            break;
+        default:
+            break;
     }
 
-    pthread_mutex_unlock(&heap->lock);
-    restore_thread_affinity();
-    return NULL;
+    return pick;
 }
 
-void free_allocator(void) {
-    size_t nodes =  get_numa_nodes_num();
+/*
+ * Detaches up to `max` blocks of a bin from the heap, recycled blocks of a span first and
+ * then fresh ones carved from its bump pointer. Spans with nothing left leave the bin's
+ * list until one of their blocks comes back. The blocks are returned linked in *out, the
+ * caller must hold the bin's lock. Returns the number of blocks detached.
+ */
+static size_t heap_take_blocks(numa_heap *heap, size_t bin_index, size_t max, free_block **out) {
+    size_t block_size = bin_size(bin_index);
+    free_block *first = NULL;
+    free_block *tail = NULL;
+    size_t taken = 0U;
+
+    while (taken < max) {
+        span *source = bin_pick_span(heap, bin_index);
+        if (source == NULL && (source = heap_new_bin_span(heap, bin_index)) == NULL) break;
+
+        while (taken < max) {
+            free_block *block;
+
+            if (source->free_list != NULL) {
+                block = source->free_list;
+                source->free_list = block->next;
+            } else if (source->bump_ptr < (char *) source->start + source->size) {
+                block = (free_block *) source->bump_ptr;
+                source->bump_ptr += block_size;
+            } else {
+                break;
+            }
+
+            source->used++;
+            if (tail == NULL) first = block;
+            else tail->next = block;
+            tail = block;
+            taken++;
+        }
 
-    for (size_t i = 0U; i < nodes; i++) {
-	numa_heap *heap = numa_heaps[i];
+        if (span_is_full(source)) span_list_remove(&heap->bins[bin_index].spans, source);
+    }
 
-            break;
-	for (size_t bin = 0U; bin < BINS; bin++) {
-	    free_block *ptr = heap->free_list[bin];
-	    free_block *to_free = NULL;
-
-	    while (ptr != NULL) {
-	        to_free = ptr;
-	        ptr = (free_block *) ptr->next;
-	        mem_dealloc(to_free, sizeof(free_block));
-	    }
-	}
-	if (heap->start_addr != NULL) mem_dealloc(heap->start_addr, heap->heap_size);
+    if (tail != NULL) tail->next = NULL;
+    *out = first;
 
-	pthread_mutex_destroy(&heap->lock);
-	mem_dealloc(heap, sizeof(numa_heap));
+    return taken;
+}
+
+/*
+ * Returns a block to its span. A span whose blocks are all back is handed to the page
+ * heap, unless it is the only span its bin has left. The caller must hold the lock of
+ * the block's bin.
+ */
+static void heap_put_block(numa_heap *heap, free_block *block) {
+    span *owner = pagemap_lookup(block);
+    heap_bin *bin = &heap->bins[owner->bin];
+
+    if (span_is_full(owner)) span_list_push(&bin->spans, owner);
+
+    block->next = owner->free_list;
+    owner->free_list = block;
+
+    if (--owner->used == 0 && (owner->prev != NULL || owner->next != NULL)) {
+        span_list_remove(&bin->spans, owner);
+
+        heap_lock(heap);
+        heap->bin_span_bytes -= owner->size;
+        heap_free_pages(heap, owner);
+        pthread_mutex_unlock(&heap->lock);
     }
+}
 
-    mem_dealloc(numa_heaps, nodes * sizeof(numa_heap *));
+/*
+ * Lock-free push onto the bin's remote free queue. Any number of threads may push
+ * concurrently, the only consumer takes the whole list at once, so there is no ABA.
+ */
+static void heap_push_remote(numa_heap *heap, size_t bin_index, free_block *block) {
+    heap_bin *bin = &heap->bins[bin_index];
+    free_block *head = __atomic_load_n(&bin->remote_free, __ATOMIC_RELAXED);
+
+    do {
+        block->next = head;
+    } while (!__atomic_compare_exchange_n(&bin->remote_free, &head, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    __atomic_fetch_add(&heap->remote_frees, 1, __ATOMIC_RELAXED);
 }
 
-void deallocate(void *ptr) {
-    assert(ptr != NULL);
+/*
+ * Returns everything remote threads freed into the bin to the spans of the blocks. The
+ * caller must hold the bin's lock.
+ */
+static void heap_drain_remote(numa_heap *heap, size_t bin_index) {
+    heap_bin *bin = &heap->bins[bin_index];
+    if (__atomic_load_n(&bin->remote_free, __ATOMIC_RELAXED) == NULL) return;
+
+    free_block *block = __atomic_exchange_n(&bin->remote_free, NULL, __ATOMIC_ACQUIRE);
+    size_t drained = 0U;
+
+    while (block != NULL) {
+        free_block *next = block->next;
+        heap_put_block(heap, block);
+        block = next;
+        drained++;
+    }
+
+    __atomic_fetch_add(&heap->remote_drains, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&heap->remote_drained_blocks, drained, __ATOMIC_RELAXED);
+}
+
+/*
+ * Moves up to `count` blocks from the head of a cached bin back to the spans of the
+ * cache's home node under a single acquisition of the bin lock.
+ */
+static void tcache_flush_bin(thread_cache *cache, size_t bin_index, size_t count) {
+    tcache_bin *bin = &cache->bins[bin_index];
+    if (bin->head == NULL || count == 0) return;
+
+    free_block *first = bin->head;
+    free_block *tail = first;
+    size_t moved = 1U;
+
+    while (moved < count && tail->next != NULL) {
+        tail = tail->next;
+        moved++;
+    }
+
+    bin->head = tail->next;
+    bin->count -= moved;
+    tail->next = NULL;
+
+    numa_heap *heap = numa_heaps[cache->node];
+    bin_lock(heap, bin_index);
+
+    while (first != NULL) {
+        free_block *next = first->next;
+        heap_put_block(heap, first);
+        first = next;
+    }
+
+    pthread_mutex_unlock(&heap->bins[bin_index].lock);
+    heap_maybe_purge(heap);
+}
+
+/*
+ * Takes a single block of the bin straight from the heap, for allocations that do not
+ * go through the calling thread's cache.
+ */
+static void *heap_alloc_block(numa_heap *heap, size_t bin_index) {
+    free_block *block = NULL;
+
+    bin_lock(heap, bin_index);
+    heap_drain_remote(heap, bin_index);
+    heap_take_blocks(heap, bin_index, 1, &block);
+    pthread_mutex_unlock(&heap->bins[bin_index].lock);
+
+    if (block != NULL) thread_count(heap->numa_node, bin_index, COUNT_ALLOCS, 1);
+    return block;
+}
+
+/*
+ * Orders the other nodes by their distance from the heap's node, ties broken by node
+ * number, leaving out those farther than max_spill_distance.
+ */
+static int heap_init_spill(numa_heap *heap, size_t nodes) {
+    size_t map_size = nodes * (sizeof(size_t) + sizeof(unsigned));
+
+    heap->spills = (size_t *) mem_alloc(map_size);
+    if (heap->spills == NULL) return -1;
+
+    heap->spill_order = (unsigned *) (heap->spills + nodes);
+    heap->spill_nodes = 0U;
+
+    int limit = alloc_config.max_spill_distance;
+    if (limit < 0) return 0;
+
+    for (unsigned node = 0U; node < nodes; node++) {
+        int distance = numa_distance(heap->numa_node, node);
+        if (node == heap->numa_node || (limit > 0 && distance > limit)) continue;
+
+        // Insertion sort, the list is as long as the machine has nodes
+        size_t slot = heap->spill_nodes++;
+        while (slot > 0 && numa_distance(heap->numa_node, heap->spill_order[slot - 1]) > distance) {
+            heap->spill_order[slot] = heap->spill_order[slot - 1];
+            slot--;
+        }
+        heap->spill_order[slot] = node;
+    }
+
+    return 0;
+}
+
+/*
+ * Takes up to `max` blocks of the bin from the nodes nearest to `node` once its own heap
+ * ran dry, taking each remote lock at most once. The blocks keep their owning node, so
+ * freeing them later sends them home.
+ */
+static size_t heap_spill(int node, size_t bin_index, size_t max, free_block **out) {
+    numa_heap *local = numa_heaps[node];
+    size_t taken = 0U;
+
+    *out = NULL;
+
+    for (size_t i = 0U; i < local->spill_nodes && taken < max; i++) {
+        unsigned target = local->spill_order[i];
+        numa_heap *heap = numa_heaps[target];
+        free_block *first;
+
+        emulate_remote_access(node, (int) target);
+        bin_lock(heap, bin_index);
+        heap_drain_remote(heap, bin_index);
+        size_t got = heap_take_blocks(heap, bin_index, max - taken, &first);
+        pthread_mutex_unlock(&heap->bins[bin_index].lock);
+
+        if (got == 0) continue;
+
+        __atomic_fetch_add(&local->spills[target], got, __ATOMIC_RELAXED);
+        taken += got;
+
+        free_block *tail = first;
+        while (tail->next != NULL) tail = tail->next;
+        tail->next = *out;
+        *out = first;
+    }
+
+    return taken;
+}
+
+/*
+ * Detaches up to tcache_batch() blocks from the bin's spans on the home node and
+ * hands them to the thread cache. Returns the number of blocks obtained.
+ */
+static size_t tcache_refill(thread_cache *cache, size_t bin_index) {
+    tcache_bin *bin = &cache->bins[bin_index];
+    numa_heap *heap = numa_heaps[cache->node];
+
+    free_block *first;
+
+    bin_lock(heap, bin_index);
+    heap_drain_remote(heap, bin_index);
+    size_t taken = heap_take_blocks(heap, bin_index, tcache_batch(bin_index), &first);
+    pthread_mutex_unlock(&heap->bins[bin_index].lock);
+
+    heap_maybe_purge(heap);
+
+    if (taken == 0) return 0;
+
+    free_block *tail = first;
+    while (tail->next != NULL) tail = tail->next;
+
+    tail->next = bin->head;
+    bin->head = first;
+    bin->count += taken;
+
+    return taken;
+}
+
+static void magazine_flush(thread_cache *cache, size_t slot, size_t count);
 
-  int node = -1;
-  for (size_t i = 0; i < get_numa_nodes_num(); i++) {
-    if (ptr >= free_lists_starting_addr[i][0] && ptr < (free_lists_starting_addr[i][BINS - 1] + size_of_heap)) {
-      node = i;	
-      break;
-    }
-  }
-
-  if (node == -1) return;
-
-  size_t bin_index = get_bin_index(16);
-  if (bin_index >= BINS) return;
-
-  numa_heap *heap = numa_heaps[node];
-  pthread_mutex_lock(&heap->lock);
-
-  free_block *to_free = (free_block *) mem_alloc(sizeof(free_block));
-  to_free->starting_addr = ptr;
-  to_free->size = 16;
-
-  to_free->next = heap->free_list[bin_index];
-  heap->free_list[bin_index] = to_free;
-
-  pthread_mutex_unlock(&heap->lock);
-}
-
-
-// void deallocate(void *ptr) {
-//   assert(ptr != NULL);
-//
-//   int node = -1;
-//   for (size_t i = 0; i < get_numa_nodes_num(); i++) {
-//     if (ptr >= free_lists_starting_addr[i][0] && ptr < (free_lists_starting_addr[i][BINS - 1] + size_of_heap)) {
-//       node = i;	
-//       break;
-//     }
-//   }
-//
-//   if (node == -1) return;
-//
-//   numa_heap *heap = numa_heaps[node];
-//   pthread_mutex_lock(&heap->lock);
-//
-//   size_t bin_index = -1;
-//   if (ptr <= free_lists_starting_addr[node][0]) bin_index = 0;
-//   else 
-//   for (size_t i = 0U; i < BINS - 1; i++) {
-//     void *temp = free_lists_starting_addr[node][i + 1];
-//     if (!temp) continue;
-//     if (ptr <= temp + (size_of_heap / BINS)) {	
-// 	    bin_index = i + 1;
-// 	    break;
-//     }
-//   }
-//   // printf("in deallocate the bin index is %ld and in node %d\n", bin_index, node);
-//   free_block *to_free = (free_block *) mem_alloc(sizeof(free_block));
-//   to_free->starting_addr = ptr;
-//
-//   to_free->size = 16 * pow(2, bin_index);
-//
-//
-//     printf("in deallocate size %d\n", to_free->size);
-//   to_free->next = NULL;
-//
-//   if (heap->free_list[bin_index] == NULL) {
-//     heap->free_list[bin_index] = to_free;
-//   } else {
-//     to_free->next = (struct free_block *) heap->free_list[bin_index];
-//     heap->free_list[bin_index] = to_free;
-//   }
-//
-//   pthread_mutex_unlock(&heap->lock);
-// }
-
-
-// void deallocate(void *ptr) {
-//     assert(ptr != NULL);
-//
-//     int node = -1;
-//     size_t num_nodes = get_numa_nodes_num();
-//
-//     // Identify which NUMA node the pointer belongs to
-//     for (size_t i = 0; i < num_nodes; i++) {
-//         void *start = free_lists_starting_addr[i][0];
-//         void *end = free_lists_starting_addr[i][BINS - 1] + size_of_heap;
-//
-//         printf("[DEBUG] Checking node %zu: ptr=%p in range [%p, %p)\n", 
-//                i, ptr, start, end);
-//
-//         if (ptr >= start && ptr < end) {
-//             node = i;
-//             break;
-//         }
-//     }
-//
-//     if (node == -1) {
-//         printf("[ERROR] Could not find NUMA node for ptr=%p\n", ptr);
-//         return;
-//     }
-//
-//     numa_heap *heap = numa_heaps[node];
-//     pthread_mutex_lock(&heap->lock);
-//
-//     size_t bin_index = (size_t)-1;
-//     printf("[DEBUG] Finding bin index for ptr=%p on node %d\n", ptr, node);
-//
-//     // Check if it falls into the first bin
-//     if (ptr <= free_lists_starting_addr[node][0]) {
-//         bin_index = 0;
-//         printf("[DEBUG] ptr <= free_lists_starting_addr[node][0], setting bin_index = 0\n");
-//     } else {
-//         // Check against the start of each bin region
-//         for (size_t i = 0; i < BINS - 1; i++) {
-//             void *region_start = free_lists_starting_addr[node][i + 1];
-//             void *region_end = region_start + (size_of_heap / BINS);
-//
-//             printf("[DEBUG] Comparing ptr=%p with bin %zu range [%p, %p)\n",
-//                    ptr, i + 1, region_start, region_end);
-//
-//             if (ptr >= region_start && ptr < region_end) {
-//                 bin_index = i + 1;
-//                 printf("[DEBUG] Matched bin index %zu\n", bin_index);
-//                 break;
-//             }
-//         }
-//     }
-//
-//     if (bin_index >= BINS) {
-//         printf("[ERROR] Invalid bin index for ptr=%p\n", ptr);
-//         pthread_mutex_unlock(&heap->lock);
-//         return;
-//     }
-//
-//     free_block *to_free = (free_block *) mem_alloc(sizeof(free_block));
-//     to_free->starting_addr = ptr;
-//     to_free->size = 16 * (1 << bin_index);  // replaced pow with bit shift for speed
-//
-//     printf("[DEBUG] Deallocating ptr=%p, size=%zu, bin_index=%zu, node=%d\n",
-//            ptr, to_free->size, bin_index, node);
-//
-//     to_free->next = heap->free_list[bin_index];
-//     heap->free_list[bin_index] = to_free;
-//
-//     pthread_mutex_unlock(&heap->lock);
-// }
-//
+/*
+ * Gives every cached block back to its home node, when the thread exits or moves to
+ * another node.
+ */
+static void tcache_release(void *arg) {
+    thread_cache *cache = (thread_cache *) arg;
+    if (cache == NULL || cache->node == -1) return;
+
+    for (size_t bin = 0U; bin < BINS; bin++) {
+        tcache_flush_bin(cache, bin, cache->bins[bin].count);
+    }
+    for (size_t slot = 0U; slot < OBJECT_CACHE_MAGAZINES; slot++) {
+        magazine_flush(cache, slot, cache->magazines[slot].count);
+    }
+
+    cache->node = -1;
+}
+
+/*
+ * Moves the thread's counts to retired_counts so they outlive it.
+ */
+static void tcache_retire_counts(thread_cache *cache) {
+    if (cache->counts == NULL) return;
+
+    pthread_mutex_lock(&stats_lock);
+    if (retired_counts != NULL) {
+        for (size_t i = 0U; i < counts_size / sizeof(size_t); i++) retired_counts[i] += cache->counts[i];
+    }
+
+    if (cache->prev != NULL) cache->prev->next = cache->next;
+    else registered_caches = cache->next;
+    if (cache->next != NULL) cache->next->prev = cache->prev;
+    pthread_mutex_unlock(&stats_lock);
+
+    mem_dealloc(cache->counts, counts_size);
+    cache->counts = NULL;
+}
+
+// pthread key destructor, runs when a thread exits
+static void tcache_exit(void *arg) {
+    thread_cache *cache = (thread_cache *) arg;
+    if (cache == NULL) return;
+
+    tcache_release(cache);
+    cache->exited = 1;
+    tcache_retire_counts(cache);
+}
+
+static void tcache_create_key(void) {
+    if (pthread_key_create(&tcache_key, tcache_exit) != 0) {
+        fprintf(stderr, "Failed to create the thread cache key\n");
+    }
+}
+
+/*
+ * Binds the calling thread's cache to `node`. A thread that migrated to another node
+ * first returns everything it cached for the old one. glibc still frees thread-local
+ * buffers after the key destructors ran, the cache then stays unbound so nothing is
+ * left in it. Returns -1 when the cache must not be used.
+ */
+static int tcache_bind(int node) {
+    if (tcache.node == node) return 0;
+    if (tcache.exited) return -1;
+
+    tcache_release(&tcache);
+    tcache.node = node;
+    pthread_setspecific(tcache_key, &tcache);
+    return 0;
+}
+
+static void large_unmap(span *run) {
+    pagemap_set(run->start, run->size, NULL);
+    mem_dealloc(run->start, run->size);
+    span_release(run);
+}
+
+static int thp_enabled(void) {
+    char mode[128] = "";
+    FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+
+    if (!file) return 0;
+    if (!fgets(mode, sizeof(mode), file)) mode[0] = '\0';
+    fclose(file);
+
+    return mode[0] != '\0' && strstr(mode, "[never]") == NULL;
+}
+
+/*
+ * Reserves the address space of a node heap with the requested backing or the best
+ * one available below it, *backing is updated to what the heap really got. Huge page
+ * reservations start on a huge page boundary.
+ */
+static void *reserve_heap(size_t size, page_backing *backing) {
+    if (*backing == hugetlbfs_pages) {
+        // No MAP_NORESERVE, a pool too small has to fail here rather than SIGBUS on a fault
+        void *ptr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) return ptr;
+
+        fprintf(stderr, "Not enough hugetlbfs pages for a %zu byte heap, falling back to transparent huge pages\n", size);
+        *backing = transparent_huge_pages;
+    }
+
+    size_t slack = *backing == transparent_huge_pages ? HUGE_PAGE_SIZE : 0U;
+    char *ptr = mmap(NULL, size + slack, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) return NULL;
+
+    if (slack > 0) {
+        char *aligned = (char *) (((size_t) ptr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+
+        if (aligned > ptr) munmap(ptr, aligned - ptr);
+        if (aligned + size < ptr + size + slack) munmap(aligned + size, ptr + slack - aligned);
+        ptr = aligned;
+
+        if (!thp_enabled() || madvise(ptr, size, MADV_HUGEPAGE) < 0) {
+            fprintf(stderr, "Transparent huge pages are not available, falling back to base pages\n");
+            *backing = base_pages;
+        }
+    }
+
+    return ptr;
+}
+
+static inline size_t large_run_size(size_t size) {
+    return (size + system_page_size - 1) & ~(system_page_size - 1);
+}
+
+/*
+ * Takes the smallest cached run of the heap that fits `size` bytes, already rounded to
+ * whole pages, onto the runs in use, or NULL if there is none. The caller must hold
+ * heap->lock.
+ */
+static span *large_cache_take(numa_heap *heap, size_t size, unsigned interleaved) {
+    span **best = NULL;
+    for (span **run = &heap->large_cache; *run != NULL; run = &(*run)->next) {
+        size_t run_size = (*run)->size;
+        if ((*run)->interleaved != interleaved) continue;
+        if (run_size < size || run_size / 2 > size) continue;
+        if (best == NULL || run_size < (*best)->size) best = run;
+    }
+
+    if (best == NULL) return NULL;
+
+    span *hit = *best;
+    *best = hit->next;
+    heap->large_cached_bytes -= hit->size;
+    if (hit->purged) heap->purged_bytes -= hit->size;
+    hit->purged = 0;
+
+    span_list_push(&heap->large_runs, hit);
+    return hit;
+}
+
+/*
+ * Maps a new run of `size` bytes, already rounded to whole pages, bound to the heap's
+ * node or with its pages interleaved over all nodes when `interleaved` is set.
+ */
+static void *large_map(numa_heap *heap, size_t size, unsigned interleaved) {
+    span *run = span_alloc();
+    if (run == NULL) return NULL;
+
+    run->start = mem_alloc(size);
+    if (run->start == NULL) {
+        span_release(run);
+        return NULL;
+    }
+
+    if (interleaved) interleave_memory(run->start, size, nodes_num);
+    else bind_memory(run->start, size, heap->numa_node);
+
+    if (heap->backing != base_pages && size >= HUGE_PAGE_SIZE) madvise(run->start, size, MADV_HUGEPAGE);
+
+    run->size = size;
+    run->node = heap->numa_node;
+    run->bin = LARGE_BIN;
+    run->interleaved = interleaved;
+    run->purged = 0;
+
+    if (pagemap_set(run->start, size, run) != 0) {
+        mem_dealloc(run->start, size);
+        span_release(run);
+        return NULL;
+    }
+
+    heap_lock(heap);
+    span_list_push(&heap->large_runs, run);
+    pthread_mutex_unlock(&heap->lock);
+
+    return run->start;
+}
+
+// Accounts large objects of the heap for the stats, `bytes` being their total size
+static void large_count(numa_heap *heap, size_t allocs, size_t frees, size_t bytes) {
+    if (allocs > 0) {
+        __atomic_fetch_add(&heap->large_allocs, allocs, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&heap->large_bytes, bytes, __ATOMIC_RELAXED);
+    }
+    if (frees > 0) {
+        __atomic_fetch_add(&heap->large_frees, frees, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&heap->large_bytes, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Returns a page run of at least `size` bytes cached by the heap, the smallest fitting
+ * cached run if there is one and a freshly mapped run otherwise.
+ */
+static void *large_alloc(numa_heap *heap, size_t size, unsigned interleaved) {
+    size = large_run_size(size);
+
+    heap_lock(heap);
+    span *hit = large_cache_take(heap, size, interleaved);
+    pthread_mutex_unlock(&heap->lock);
+
+    if (hit != NULL) {
+        large_count(heap, 1, 0, hit->size);
+        return hit->start;
+    }
+
+    void *run = large_map(heap, size, interleaved);
+    if (run != NULL) large_count(heap, 1, 0, size);
+
+    return run;
+}
+
+/*
+ * Moves a freed large run from the heap's runs in use to its cache. Once the cache
+ * holds more than LARGE_CACHE_BYTES the least recently freed runs are moved to *evicted,
+ * for the caller to unmap once it dropped heap->lock, which it must hold here.
+ */
+static void large_cache_put(numa_heap *heap, span *run, span **evicted) {
+    span_list_remove(&heap->large_runs, run);
+
+    run->freed_at = now_ms();
+    run->next = heap->large_cache;
+    heap->large_cache = run;
+    heap->large_cached_bytes += run->size;
+
+    while (heap->large_cached_bytes > LARGE_CACHE_BYTES) {
+        span **oldest = &heap->large_cache;
+        while ((*oldest)->next != NULL) oldest = &(*oldest)->next;
+
+        span *victim = *oldest;
+        *oldest = NULL;
+        heap->large_cached_bytes -= victim->size;
+        if (victim->purged) heap->purged_bytes -= victim->size;
+
+        victim->next = *evicted;
+        *evicted = victim;
+    }
+}
+
+static void large_unmap_all(span *runs) {
+    while (runs != NULL) {
+        span *next = runs->next;
+        large_unmap(runs);
+        runs = next;
+    }
+}
+
+static void large_free(span *run) {
+    numa_heap *heap = numa_heaps[run->node];
+    span *evicted = NULL;
+
+    large_count(heap, 0, 1, run->size);
+    int local = tcache.node != -1 ? tcache.node : numa_node_of_cpu(sched_getcpu());
+    if (local != (int) run->node) __atomic_fetch_add(&heap->large_remote_frees, 1, __ATOMIC_RELAXED);
+
+    heap_lock(heap);
+    large_cache_put(heap, run, &evicted);
+    pthread_mutex_unlock(&heap->lock);
+
+    heap_maybe_purge(heap);
+
+    large_unmap_all(evicted);
+}
+
+/*
+ * Sets up the heap of node `i`, reserving its address space and, in prefault mode,
+ * faulting in its first prefault_size bytes.
+ */
+static int init_heap(size_t i, size_t reserved_size, size_t prefault_size) {
+    numa_heaps[i] = (numa_heap *) mem_alloc(sizeof(numa_heap));
+    numa_heap *heap = numa_heaps[i];
+    if (heap == NULL) return -1;
+
+    // Only address space for now, memory gets committed chunk by chunk
+    heap->backing = alloc_config.huge_pages;
+    heap->policy = alloc_config.node_policies != NULL ? alloc_config.node_policies[i] : alloc_config.policy;
+    heap->start_addr = reserve_heap(reserved_size, &heap->backing);
+    if (heap->start_addr == NULL) {
+        fprintf(stderr, "Failed to reserve %zu bytes for NUMA heap %zu\n", reserved_size, i);
+        return -1;
+    }
+
+    // Bound once, every page committed later is placed on the node without pinning anyone
+    bind_memory(heap->start_addr, reserved_size, i);
+
+    heap->reserved_size = reserved_size;
+    heap->heap_size = 0U;
+    heap->used_size = 0U;
+    heap->numa_node = i;
+
+    for (size_t bin = 0U; bin < BINS; bin++) {
+        heap->bins[bin].spans = NULL;
+        heap->bins[bin].remote_free = NULL;
+        heap->bins[bin].lock_acquisitions = 0U;
+        heap->bins[bin].contended_acquisitions = 0U;
+        if (pthread_mutex_init(&heap->bins[bin].lock, NULL) != 0) {
+            fprintf(stderr, "Failed to initialize mutex for bin %zu of NUMA heap %zu\n", bin, i);
+            return -1;
+        }
+    }
+    for (size_t list = 0U; list < FREE_SPAN_LISTS; list++) {
+        heap->free_spans[list] = NULL;
+    }
+    heap->large_cache = NULL;
+    heap->large_runs = NULL;
+    heap->large_cached_bytes = 0U;
+    heap->bin_span_bytes = 0U;
+    heap->lock_acquisitions = 0U;
+    heap->contended_acquisitions = 0U;
+    heap->large_allocs = 0U;
+    heap->large_frees = 0U;
+    heap->large_remote_frees = 0U;
+    heap->large_bytes = 0U;
+    heap->remote_frees = 0U;
+    heap->remote_drains = 0U;
+    heap->remote_drained_blocks = 0U;
+    heap->purged_bytes = 0U;
+    heap->tail_resident = 0U;
+    heap->tail_purged = 0U;
+    heap->tail_freed_at = 0U;
+    heap->last_purge = now_ms();
+    heap->purges = 0U;
+
+    if (prefault_size > 0) heap_commit(heap, prefault_size);
+
+    if (pthread_mutex_init(&heap->lock, NULL) != 0) {
+        fprintf(stderr, "Failed to initialize mutex for NUMA heap %zu\n", i);
+        return -1;
+    }
+
+    if (heap_init_spill(heap, nodes_num) != 0) {
+        fprintf(stderr, "Failed to set up spilling for NUMA heap %zu\n", i);
+        return -1;
+    }
+
+    return 0;
+}
+
+typedef struct {
+    size_t node;
+    size_t reserved_size;
+    size_t prefault_size;
+    int result;
+} heap_init_job;
+
+static void *heap_init_worker(void *arg) {
+    heap_init_job *job = (heap_init_job *) arg;
+
+    // Pages are zeroed by the CPU that faults them in, one on their own node does it fastest
+    for (size_t cpu = 0U; cpu < current_topology->cpus_num; cpu++) {
+        if (current_topology->cpu_on_node[cpu] != (int) job->node) continue;
+
+        set_thread_affinity((int) job->node);
+        break;
+    }
+
+    job->result = init_heap(job->node, job->reserved_size, job->prefault_size);
+    return NULL;
+}
+
+/*
+ * Prefaulting is bound by the page fault rate of one core, so every node heap gets a
+ * worker running on the node. Heaps that only reserve address space are set up right
+ * here, that is cheaper than starting threads.
+ */
+static int init_heaps(size_t nodes, size_t reserved_size, size_t prefault_size) {
+    if (prefault_size == 0 || nodes == 1) {
+        for (size_t i = 0U; i < nodes; i++) {
+            if (init_heap(i, reserved_size, prefault_size) != 0) return -1;
+        }
+        return 0;
+    }
+
+    heap_init_job jobs[nodes];
+    pthread_t workers[nodes];
+    int started[nodes];
+
+    for (size_t i = 0U; i < nodes; i++) {
+        jobs[i] = (heap_init_job) { i, reserved_size, prefault_size, -1 };
+        started[i] = pthread_create(&workers[i], NULL, heap_init_worker, &jobs[i]) == 0;
+
+        // Without a worker the node is set up by this thread, which stays unpinned
+        if (!started[i]) jobs[i].result = init_heap(i, reserved_size, prefault_size);
+    }
+
+    int result = 0;
+    for (size_t i = 0U; i < nodes; i++) {
+        if (started[i]) pthread_join(workers[i], NULL);
+        if (jobs[i].result != 0) result = -1;
+    }
+
+    return result;
+}
+
+static void stats_signal_handler(int signal) {
+    (void) signal;
+
+    // The only async-signal-safe way to wake the dump thread
+    sem_post(&stats_wakeup);
+}
+
+/*
+ * Prints the stats every time the signal handler posts, a signal handler itself could
+ * not take the locks they are gathered under.
+ */
+static void *stats_dump_thread(void *arg) {
+    (void) arg;
+
+    while (1) {
+        if (sem_wait(&stats_wakeup) != 0) continue;
+        if (__atomic_load_n(&stats_stop, __ATOMIC_ACQUIRE)) break;
+
+        print_allocator_stats(stderr);
+    }
+
+    return NULL;
+}
+
+static void stats_dump_at_exit(void) {
+    if (numa_heaps != NULL) print_allocator_stats(stderr);
+}
+
+static int env_int(const char *name) {
+    const char *value = getenv(name);
+    return value != NULL ? atoi(value) : 0;
+}
+
+static void stats_setup_dumps(const allocator_config *config) {
+    static int exit_dump_registered;
+    int signal_number = config->stats_signal ? config->stats_signal : env_int("NUMA_ALLOC_STATS_SIGNAL");
+    int at_exit = config->stats_at_exit ? config->stats_at_exit : env_int("NUMA_ALLOC_STATS_AT_EXIT");
+
+    if (at_exit && !exit_dump_registered && atexit(stats_dump_at_exit) == 0) exit_dump_registered = 1;
+    if (signal_number <= 0 || stats_thread_running) return;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stats_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if (sem_init(&stats_wakeup, 0, 0) != 0) {
+        perror("sem_init failed");
+        return;
+    }
+
+    stats_stop = 0;
+    if (pthread_create(&stats_thread, NULL, stats_dump_thread, NULL) != 0) {
+        fprintf(stderr, "Failed to start the stats dump thread\n");
+        sem_destroy(&stats_wakeup);
+        return;
+    }
+
+    if (sigaction(signal_number, &action, &stats_old_action) != 0) {
+        perror("sigaction failed");
+        __atomic_store_n(&stats_stop, 1, __ATOMIC_RELEASE);
+        sem_post(&stats_wakeup);
+        pthread_join(stats_thread, NULL);
+        sem_destroy(&stats_wakeup);
+        return;
+    }
+
+    stats_thread_running = signal_number;
+}
+
+static void stats_stop_dumps(void) {
+    if (!stats_thread_running) return;
+
+    sigaction(stats_thread_running, &stats_old_action, NULL);
+    __atomic_store_n(&stats_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&stats_wakeup);
+    pthread_join(stats_thread, NULL);
+    sem_destroy(&stats_wakeup);
+    stats_thread_running = 0;
+}
+
+void init_allocator(size_t heap_size) {
+    allocator_config config = { .heap_size = heap_size };
+    init_allocator_with_config(&config);
+}
+
+/*
+ * Returns -1 when the topology, the page map or a node heap could not be set up, the
+ * allocator must not be used then.
+ */
+int init_allocator_with_config(const allocator_config *config) {
+    assert(config != NULL && config->heap_size > 0);
+    pthread_once(&tcache_key_once, tcache_create_key);
+    numa_emulation emulation = { config->emulate_nodes, config->emulate_distance, config->emulate_delay_ns };
+    if (init_numa_topology(&emulation) != 0) return -1;
+    size_t nodes = current_topology->nodes_num;
+    size_t size = nodes * sizeof(struct numa_heap *);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    system_page_size = page_size;
+    alloc_config = *config;
+    if (alloc_config.chunk_size == 0) alloc_config.chunk_size = ALLOC_DEFAULT_CHUNK_SIZE;
+    if (alloc_config.chunk_size < bin_size(BINS - 1)) alloc_config.chunk_size = bin_size(BINS - 1);
+    alloc_config.chunk_size = (alloc_config.chunk_size + page_size - 1) & ~(page_size - 1);
+    if (alloc_config.huge_pages != base_pages) {
+        alloc_config.chunk_size = (alloc_config.chunk_size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    }
+
+    if (alloc_config.max_heap_size == 0) alloc_config.max_heap_size = ALLOC_DEFAULT_MAX_HEAP_SIZE;
+    if (alloc_config.purge_decay_ms == 0) alloc_config.purge_decay_ms = ALLOC_DEFAULT_PURGE_DECAY_MS;
+    if (alloc_config.max_heap_size < alloc_config.heap_size) alloc_config.max_heap_size = alloc_config.heap_size;
+
+    const char *policy = getenv("NUMA_ALLOC_POLICY");
+    if (policy != NULL && alloc_config.policy == segregated_free_lists && alloc_config.node_policies == NULL) {
+        if (strcmp(policy, "best_fit") == 0) alloc_config.policy = best_fit_within_a_bin;
+        else if (strcmp(policy, "address_ordered") == 0) alloc_config.policy = address_ordered_first_fit;
+        else if (strcmp(policy, "segregated") != 0) fprintf(stderr, "Unknown NUMA_ALLOC_POLICY %s\n", policy);
+    }
+
+    // Heaps grow chunk by chunk, so both sizes are kept in whole chunks
+    size_t chunk = alloc_config.chunk_size;
+    size_t prefault_size = alloc_config.prefault ? (alloc_config.heap_size + chunk - 1) / chunk * chunk : 0;
+    size_t reserved_size = (alloc_config.max_heap_size + chunk - 1) / chunk * chunk;
+
+    if (pagemap_init() != 0) return -1;
+
+    numa_heaps = (numa_heap **) mem_alloc(size);
+    if (numa_heaps == NULL) return -1;
+    nodes_num = nodes;
+
+    retired_counts = (size_t *) mem_alloc(nodes * COUNT_ROWS * COUNT_KINDS * sizeof(size_t));
+    if (retired_counts == NULL) return -1;
+    counts_size = nodes * COUNT_ROWS * COUNT_KINDS * sizeof(size_t);
+
+    if (init_heaps(nodes, reserved_size, prefault_size) != 0) return -1;
+
+    stats_setup_dumps(config);
+
+    return 0;
+}
+
+/*
+ * Allocates through the thread's cache bound to `node`, the node the caller found the
+ * thread on. Only with `spill` set may small objects come from other nodes once the
+ * node's heap ran dry.
+ */
+static void *allocate_from_cache(int node, size_t size, int spill) {
+    numa_heap *heap = numa_heaps[node];
+    if (!heap) return NULL;
+
+    size_t bin_index = get_bin_index(size);
+    if (bin_index >= BINS) return large_alloc(heap, size, 0);
+
+    if (tcache_bind(node) != 0) return heap_alloc_block(heap, bin_index);
+    tcache_bin *bin = &tcache.bins[bin_index];
+
+    if (bin->head == NULL && tcache_refill(&tcache, bin_index) == 0) {
+        // Spilled blocks belong to another node and bypass the node bound cache
+        free_block *block;
+        if (!spill || heap_spill(node, bin_index, 1, &block) == 0) return NULL;
+
+        thread_count(pagemap_lookup(block)->node, bin_index, COUNT_ALLOCS, 1);
+        return block;
+    }
+
+    free_block *block = bin->head;
+    bin->head = block->next;
+    bin->count--;
+
+    thread_count(node, bin_index, COUNT_ALLOCS, 1);
+    return block;
+}
+
+void *allocate_localy(size_t size) {
+    assert(size > 0);
+
+    int cpu = sched_getcpu();
+    if (cpu == -1) return NULL;
+    
+    int node = numa_node_of_cpu(cpu);
+    if (node == -1) return NULL;
+
+    return allocate_from_cache(node, size, 1);
+}
+
+/*
+ * Small objects go to the nodes round-robin, one object per node in turn. Large objects
+ * have their pages spread over all nodes like MPOL_INTERLEAVE, so a single big table
+ * gets the bandwidth of every memory controller.
+ */
+void *allocate_interleaved(size_t size) {
+    assert(size > 0);
+
+    size_t node = interleave_cursor++ % nodes_num;
+
+    numa_heap *heap = numa_heaps[node];
+    if (!heap) return NULL;
+
+    emulate_remote_access(tcache.node, (int) node);
+
+    size_t bin_index = get_bin_index(size);
+    if (bin_index >= BINS) return large_alloc(heap, size, 1);
+
+    return heap_alloc_block(heap, bin_index);
+}
+
+/*
+ * Allocates on `node` whichever node the thread runs on. Allocations for the thread's
+ * own node go through its cache, others take the node's heap lock, which makes this
+ * meant for placement decisions rather than hot loops on remote nodes.
+ */
+void *allocate_on_node(int node, size_t size) {
+    assert(size > 0);
+
+    if (node < 0 || (size_t) node >= nodes_num) {
+        fprintf(stderr, "Invalid NUMA node: %d\n", node);
+        return NULL;
+    }
+
+    // Placement is explicit, a node out of memory fails rather than spilling
+    int local = numa_node_of_cpu(sched_getcpu());
+    if (node == local) return allocate_from_cache(node, size, 0);
+
+    emulate_remote_access(local, node);
+
+    numa_heap *heap = numa_heaps[node];
+    size_t bin_index = get_bin_index(size);
+    if (bin_index >= BINS) return large_alloc(heap, size, 0);
+
+    return heap_alloc_block(heap, bin_index);
+}
+
+/*
+ * Colocates a new object with `ptr`, typically a child with its parent. Objects the
+ * allocator does not own give no hint, the new one is then local.
+ */
+void *allocate_near(const void *ptr, size_t size) {
+    int node = ptr != NULL ? node_of(ptr) : -1;
+    if (node == -1) return allocate_localy(size);
+
+    return allocate_on_node(node, size);
+}
+
+/*
+ * Node of the memory at `ptr`, -1 for pointers the allocator does not own. Pages of
+ * interleaved large objects are spread over the nodes, so the kernel is asked where
+ * that one page is.
+ */
+int node_of(const void *ptr) {
+    span *owner = pagemap_lookup(ptr);
+    if (owner == NULL || owner->bin == FREE_BIN) return -1;
+
+    if (owner->bin == LARGE_BIN && owner->interleaved) return page_node(ptr);
+
+    return (int) owner->node;
+}
+
+/*
+ * Allocates `count` objects of `size` bytes on the local node into out[], what the
+ * thread cache holds first and the rest from the heap under one acquisition of its
+ * lock. Large objects come from the run cache under one acquisition as well, missing
+ * runs are mapped after it. Returns how many objects were allocated, fewer than count
+ * only when the heap is exhausted.
+ */
+size_t allocate_batch(size_t size, size_t count, void **out) {
+    assert(size > 0);
+
+    int node = numa_node_of_cpu(sched_getcpu());
+    if (node == -1) return 0;
+
+    numa_heap *heap = numa_heaps[node];
+    size_t bin_index = get_bin_index(size);
+    size_t done = 0U;
+
+    if (bin_index >= BINS) {
+        size = large_run_size(size);
+
+        heap_lock(heap);
+        for (span *hit; done < count && (hit = large_cache_take(heap, size, 0)) != NULL; done++) {
+            out[done] = hit->start;
+        }
+        pthread_mutex_unlock(&heap->lock);
+
+        size_t cached = done;
+        for (size_t i = 0U; i < cached; i++) large_count(heap, 1, 0, pagemap_lookup(out[i])->size);
+
+        for (; done < count && (out[done] = large_map(heap, size, 0)) != NULL; done++);
+        large_count(heap, done - cached, 0, (done - cached) * size);
+        return done;
+    }
+
+    // A thread past its exit destructor takes everything from the heap
+    if (tcache_bind(node) == 0) {
+        tcache_bin *bin = &tcache.bins[bin_index];
+
+        while (done < count && bin->head != NULL) {
+            out[done++] = bin->head;
+            bin->head = bin->head->next;
+            bin->count--;
+        }
+    }
+
+    if (done == count) {
+        thread_count(node, bin_index, COUNT_ALLOCS, done);
+        return done;
+    }
+
+    free_block *first = NULL;
+
+    bin_lock(heap, bin_index);
+    heap_drain_remote(heap, bin_index);
+    heap_take_blocks(heap, bin_index, count - done, &first);
+    pthread_mutex_unlock(&heap->bins[bin_index].lock);
+
+    for (; first != NULL; first = first->next) out[done++] = first;
+    thread_count(node, bin_index, COUNT_ALLOCS, done);
+
+    // Spilled blocks are counted against the node they came from
+    if (done < count) {
+        heap_spill(node, bin_index, count - done, &first);
+        for (; first != NULL; first = first->next) {
+            thread_count(pagemap_lookup(first)->node, bin_index, COUNT_ALLOCS, 1);
+            out[done++] = first;
+        }
+    }
+
+    return done;
+}
+
+/*
+ * Frees `count` objects in one pass. The objects are first sorted by owning node, linked
+ * through their first word (large runs stay on the heap's list of runs in use), then
+ * every node's share is split by bin and each bin lock is taken once to give it back.
+ * Objects of an object cache go back one by one through object_cache_free().
+ */
+void deallocate_batch(void **ptrs, size_t count) {
+    free_block *blocks[nodes_num];
+    span *runs[nodes_num];
+    int local = tcache.node != -1 ? tcache.node : numa_node_of_cpu(sched_getcpu());
+
+    for (size_t node = 0U; node < nodes_num; node++) {
+        blocks[node] = NULL;
+        runs[node] = NULL;
+    }
+
+    for (size_t i = 0U; i < count; i++) {
+        span *owner = ptrs[i] != NULL ? pagemap_lookup(ptrs[i]) : NULL;
+        if (owner == NULL || owner->bin == FREE_BIN) continue;
+
+        if (owner->bin == CACHE_BIN) {
+            object_cache_free(owner->cache, ptrs[i]);
+        } else if (owner->bin == LARGE_BIN) {
+            *(span **) owner->start = runs[owner->node];
+            runs[owner->node] = owner;
+        } else {
+            free_block *block = (free_block *) ptrs[i];
+            block->next = blocks[owner->node];
+            blocks[owner->node] = block;
+        }
+    }
+
+    for (size_t node = 0U; node < nodes_num; node++) {
+        if (blocks[node] == NULL && runs[node] == NULL) continue;
+
+        numa_heap *heap = numa_heaps[node];
+        free_block *bins[BINS] = { NULL };
+        span *evicted = NULL;
+
+        emulate_remote_access(tcache.node, (int) node);
+
+        for (free_block *block = blocks[node]; block != NULL;) {
+            free_block *next = block->next;
+            size_t bin_index = pagemap_lookup(block)->bin;
+            block->next = bins[bin_index];
+            bins[bin_index] = block;
+            block = next;
+        }
+
+        for (size_t bin_index = 0U; bin_index < BINS; bin_index++) {
+            if (bins[bin_index] == NULL) continue;
+
+            size_t freed = 0U;
+
+            bin_lock(heap, bin_index);
+            for (free_block *block = bins[bin_index]; block != NULL; freed++) {
+                free_block *next = block->next;
+                heap_put_block(heap, block);
+                block = next;
+            }
+            pthread_mutex_unlock(&heap->bins[bin_index].lock);
+
+            thread_count(node, bin_index, COUNT_FREES, freed);
+            if ((int) node != local) thread_count(node, bin_index, COUNT_REMOTE_FREES, freed);
+        }
+
+        if (runs[node] != NULL) {
+            heap_lock(heap);
+            for (span *run = runs[node]; run != NULL;) {
+                span *next = *(span **) run->start;
+                large_count(heap, 0, 1, run->size);
+                if ((int) node != local) __atomic_fetch_add(&heap->large_remote_frees, 1, __ATOMIC_RELAXED);
+                large_cache_put(heap, run, &evicted);
+                run = next;
+            }
+            pthread_mutex_unlock(&heap->lock);
+        }
+
+        heap_maybe_purge(heap);
+        large_unmap_all(evicted);
+    }
+}
+
+/*
+ * Blocks threads of node `from` took from node `to` because their own heap was
+ * exhausted. A steadily growing count means `from`'s heap is undersized.
+ */
+size_t get_spill_count(unsigned from, unsigned to) {
+    if (from >= nodes_num || to >= nodes_num) return 0;
+
+    return __atomic_load_n(&numa_heaps[from]->spills[to], __ATOMIC_RELAXED);
+}
+
+/*
+ * Bytes usable from `ptr` on, 0 for pointers the allocator does not own. Blocks use
+ * their whole bin, objects of a cache its size, large objects whatever is left of their
+ * page run.
+ */
+size_t get_allocation_size(const void *ptr) {
+    span *owner = pagemap_lookup(ptr);
+    if (owner == NULL || owner->bin == FREE_BIN) return 0;
+
+    if (owner->bin == LARGE_BIN) return (size_t) ((char *) owner->start + owner->size - (const char *) ptr);
+    if (owner->bin == CACHE_BIN) return owner->cache->size;
+
+    return bin_size(owner->bin);
+}
+
+/*
+ * Purges all free memory of every heap right away, whatever the decay time.
+ */
+void purge_allocator(void) {
+    unsigned long now = now_ms();
+
+    for (size_t node = 0U; node < nodes_num; node++) {
+        numa_heap *heap = numa_heaps[node];
+
+        heap_lock(heap);
+        heap_purge(heap, now, 0);
+        pthread_mutex_unlock(&heap->lock);
+    }
+}
+
+/*
+ * Takes every allocator lock in the order the allocator nests them, so no other thread
+ * is in the middle of an update when the process forks: the object cache locks before
+ * the heap locks, the bin locks of every heap before any page heap lock, and the span
+ * pool and page map last.
+ */
+void allocator_fork_prepare(void) {
+    pthread_mutex_lock(&stats_lock);
+    pthread_mutex_lock(&caches_lock);
+    for (object_cache *cache = live_caches; cache != NULL; cache = cache->next) {
+        for (size_t node = 0U; node < cache->nodes; node++) pthread_mutex_lock(&cache->node[node].lock);
+    }
+
+    if (numa_heaps != NULL) {
+        for (size_t node = 0U; node < nodes_num; node++) {
+            for (size_t bin = 0U; bin < BINS; bin++) pthread_mutex_lock(&numa_heaps[node]->bins[bin].lock);
+        }
+        for (size_t node = 0U; node < nodes_num; node++) pthread_mutex_lock(&numa_heaps[node]->lock);
+    }
+
+    pthread_mutex_lock(&span_pool_lock);
+    pagemap_lock();
+}
+
+static void allocator_fork_release(void) {
+    pagemap_unlock();
+    pthread_mutex_unlock(&span_pool_lock);
+
+    if (numa_heaps != NULL) {
+        for (size_t node = 0U; node < nodes_num; node++) pthread_mutex_unlock(&numa_heaps[node]->lock);
+        for (size_t node = 0U; node < nodes_num; node++) {
+            for (size_t bin = 0U; bin < BINS; bin++) pthread_mutex_unlock(&numa_heaps[node]->bins[bin].lock);
+        }
+    }
+
+    for (object_cache *cache = live_caches; cache != NULL; cache = cache->next) {
+        for (size_t node = 0U; node < cache->nodes; node++) pthread_mutex_unlock(&cache->node[node].lock);
+    }
+    pthread_mutex_unlock(&caches_lock);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void allocator_fork_parent(void) {
+    allocator_fork_release();
+}
+
+// The forking thread took the locks, so it may release them in the child as well
+void allocator_fork_child(void) {
+    allocator_fork_release();
+}
+
+static size_t resident_pages(void *start, size_t size) {
+    unsigned char pages[4096];
+    size_t resident = 0U;
+
+    for (size_t offset = 0U; offset < size; offset += sizeof(pages) * system_page_size) {
+        size_t length = size - offset;
+        if (length > sizeof(pages) * system_page_size) length = sizeof(pages) * system_page_size;
+
+        if (mincore((char *) start + offset, length, pages) < 0) break;
+
+        for (size_t page = 0U; page < (length + system_page_size - 1) / system_page_size; page++) {
+            resident += pages[page] & 1;
+        }
+    }
+
+    return resident * system_page_size;
+}
+
+/*
+ * Bytes of the node's heap and cached large runs the OS actually has in memory. Objects
+ * in use and lazily purged pages the kernel did not reclaim yet count as resident.
+ */
+size_t get_heap_resident_bytes(unsigned node) {
+    if (node >= nodes_num) return 0;
+
+    numa_heap *heap = numa_heaps[node];
+
+    heap_lock(heap);
+    size_t resident = resident_pages(heap->start_addr, heap->heap_size);
+    for (span *run = heap->large_cache; run != NULL; run = run->next) {
+        resident += resident_pages(run->start, run->size);
+    }
+    pthread_mutex_unlock(&heap->lock);
+
+    return resident;
+}
+
+/*
+ * Free bytes of the node the purger gave back and no allocation reused since.
+ */
+size_t get_heap_purged_bytes(unsigned node) {
+    if (node >= nodes_num) return 0;
+
+    numa_heap *heap = numa_heaps[node];
+
+    heap_lock(heap);
+    size_t purged = heap->purged_bytes + heap->tail_purged;
+    pthread_mutex_unlock(&heap->lock);
+
+    return purged;
+}
+
+page_backing get_heap_backing(unsigned node) {
+    assert(node < nodes_num);
+    return numa_heaps[node]->backing;
+}
+
+static void add_bin_stats(allocator_bin_stats *sum, const allocator_bin_stats *bin) {
+    sum->allocations += bin->allocations;
+    sum->frees += bin->frees;
+    sum->remote_frees += bin->remote_frees;
+    sum->bytes_in_use += bin->bytes_in_use;
+    sum->free_bytes += bin->free_bytes;
+    sum->lock_acquisitions += bin->lock_acquisitions;
+    sum->contended_acquisitions += bin->contended_acquisitions;
+}
+
+static void add_node_stats(allocator_node_stats *sum, const allocator_node_stats *node) {
+    for (size_t bin = 0U; bin <= BINS; bin++) add_bin_stats(&sum->bins[bin], &node->bins[bin]);
+    add_bin_stats(&sum->object_caches, &node->object_caches);
+
+    sum->committed_bytes += node->committed_bytes;
+    sum->free_bytes += node->free_bytes;
+    sum->free_span_bytes += node->free_span_bytes;
+    sum->bin_span_bytes += node->bin_span_bytes;
+    sum->stranded_bytes += node->stranded_bytes;
+    if (node->largest_free_span > sum->largest_free_span) sum->largest_free_span = node->largest_free_span;
+    sum->purged_bytes += node->purged_bytes;
+    sum->spills += node->spills;
+    sum->lock_acquisitions += node->lock_acquisitions;
+    sum->contended_acquisitions += node->contended_acquisitions;
+}
+
+/*
+ * Sums the thread counters up and reads the heap state, every lock held only as long as
+ * it takes to read what it guards, so the allocator keeps running meanwhile. The locks
+ * are taken without counting to leave the lock counters as the program made them.
+ * Returns NULL before init or when out of memory, free the result with
+ * free_allocator_stats().
+ */
+allocator_stats *get_allocator_stats(void) {
+    if (numa_heaps == NULL) return NULL;
+
+    size_t nodes = nodes_num;
+    allocator_stats *stats = (allocator_stats *) mem_alloc(sizeof(allocator_stats) + nodes * sizeof(allocator_node_stats));
+    size_t *counts = (size_t *) mem_alloc(counts_size);
+
+    if (stats == NULL || counts == NULL) {
+        if (stats != NULL) mem_dealloc(stats, sizeof(allocator_stats) + nodes * sizeof(allocator_node_stats));
+        return NULL;
+    }
+
+    stats->nodes_num = nodes;
+    stats->nodes = (allocator_node_stats *) (stats + 1);
+
+    pthread_mutex_lock(&stats_lock);
+    for (size_t i = 0U; i < counts_size / sizeof(size_t); i++) counts[i] = retired_counts[i];
+    for (thread_cache *cache = registered_caches; cache != NULL; cache = cache->next) {
+        for (size_t i = 0U; i < counts_size / sizeof(size_t); i++) {
+            counts[i] += __atomic_load_n(&cache->counts[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    for (size_t node = 0U; node < nodes; node++) {
+        numa_heap *heap = numa_heaps[node];
+        allocator_node_stats *result = &stats->nodes[node];
+
+        for (size_t bin_index = 0U; bin_index < BINS; bin_index++) {
+            allocator_bin_stats *bin = &result->bins[bin_index];
+            size_t *count = &counts[(node * COUNT_ROWS + bin_index) * COUNT_KINDS];
+            size_t block_size = bin_size(bin_index);
+
+            bin->allocations = count[COUNT_ALLOCS];
+            bin->frees = count[COUNT_FREES];
+            bin->remote_frees = count[COUNT_REMOTE_FREES];
+
+            // Frees of another thread may be summed up before the allocations they match
+            if (bin->allocations > bin->frees) bin->bytes_in_use = (bin->allocations - bin->frees) * block_size;
+
+            pthread_mutex_lock(&heap->bins[bin_index].lock);
+            for (span *source = heap->bins[bin_index].spans; source != NULL; source = source->next) {
+                size_t free_bytes = (source->size / block_size - source->used) * block_size;
+
+                bin->free_bytes += free_bytes;
+                if (source->used > 0) result->stranded_bytes += free_bytes;
+            }
+            bin->lock_acquisitions = heap->bins[bin_index].lock_acquisitions;
+            bin->contended_acquisitions = heap->bins[bin_index].contended_acquisitions;
+            pthread_mutex_unlock(&heap->bins[bin_index].lock);
+        }
+
+        // Objects held in thread magazines count as in use, the slabs only know them as taken
+        allocator_bin_stats *caches = &result->object_caches;
+        size_t *cache_count = &counts[(node * COUNT_ROWS + CACHE_ROW) * COUNT_KINDS];
+
+        caches->allocations = cache_count[COUNT_ALLOCS];
+        caches->frees = cache_count[COUNT_FREES];
+        caches->remote_frees = cache_count[COUNT_REMOTE_FREES];
+
+        pthread_mutex_lock(&caches_lock);
+        for (object_cache *cache = live_caches; cache != NULL; cache = cache->next) {
+            pthread_mutex_lock(&cache->node[node].lock);
+            span *lists[] = { cache->node[node].slabs, cache->node[node].full };
+            for (size_t list = 0U; list < 2; list++) {
+                for (span *slab = lists[list]; slab != NULL; slab = slab->next) {
+                    caches->bytes_in_use += slab->used * cache->stride;
+                    caches->free_bytes += slab->size - slab->used * cache->stride;
+                }
+            }
+            pthread_mutex_unlock(&cache->node[node].lock);
+        }
+        pthread_mutex_unlock(&caches_lock);
+
+        allocator_bin_stats *large = &result->bins[LARGE_BIN];
+        large->allocations = __atomic_load_n(&heap->large_allocs, __ATOMIC_RELAXED);
+        large->frees = __atomic_load_n(&heap->large_frees, __ATOMIC_RELAXED);
+        large->remote_frees = __atomic_load_n(&heap->large_remote_frees, __ATOMIC_RELAXED);
+        large->bytes_in_use = __atomic_load_n(&heap->large_bytes, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&heap->lock);
+        large->free_bytes = heap->large_cached_bytes;
+        result->committed_bytes = heap->heap_size;
+        result->bin_span_bytes = heap->bin_span_bytes;
+        for (size_t list = 0U; list < FREE_SPAN_LISTS; list++) {
+            for (span *free_span = heap->free_spans[list]; free_span != NULL; free_span = free_span->next) {
+                result->free_span_bytes += free_span->size;
+                if (free_span->size > result->largest_free_span) result->largest_free_span = free_span->size;
+            }
+        }
+        result->free_bytes = heap->heap_size - heap->used_size + result->free_span_bytes;
+        result->purged_bytes = heap->purged_bytes + heap->tail_purged;
+        result->lock_acquisitions = heap->lock_acquisitions;
+        result->contended_acquisitions = heap->contended_acquisitions;
+        pthread_mutex_unlock(&heap->lock);
+
+        for (size_t target = 0U; target < nodes; target++) {
+            result->spills += __atomic_load_n(&heap->spills[target], __ATOMIC_RELAXED);
+        }
+
+        add_node_stats(&stats->total, result);
+    }
+
+    for (size_t node = 0U; node <= nodes; node++) {
+        allocator_node_stats *result = node < nodes ? &stats->nodes[node] : &stats->total;
+
+        if (result->bin_span_bytes > 0) {
+            result->span_fragmentation = (double) result->stranded_bytes / result->bin_span_bytes;
+        }
+        if (result->free_span_bytes > 0) {
+            result->page_fragmentation = 1.0 - (double) result->largest_free_span / result->free_span_bytes;
+        }
+    }
+
+    mem_dealloc(counts, counts_size);
+    return stats;
+}
+
+void free_allocator_stats(allocator_stats *stats) {
+    if (stats == NULL) return;
+
+    mem_dealloc(stats, sizeof(allocator_stats) + stats->nodes_num * sizeof(allocator_node_stats));
+}
+
+allocation_policy get_heap_policy(unsigned node) {
+    assert(node < nodes_num);
+    return numa_heaps[node]->policy;
+}
+
+const char *allocation_policy_name(allocation_policy policy) {
+    switch (policy) {
+        case best_fit_within_a_bin: return "best_fit";
+        case address_ordered_first_fit: return "address_ordered";
+        default: return "segregated";
+    }
+}
+
+const char *page_backing_name(page_backing backing) {
+    switch (backing) {
+        case transparent_huge_pages: return "transparent huge pages";
+        case hugetlbfs_pages: return "hugetlbfs pages";
+        default: return "base pages";
+    }
+}
+
+void free_allocator(void) {
+    size_t nodes = nodes_num;
+
+    stats_stop_dumps();
+
+    // Caches of threads that already exited were flushed by their key destructor
+    tcache_release(&tcache);
+
+    // Threads still running must not allocate again before the next init
+    pthread_mutex_lock(&stats_lock);
+    for (thread_cache *cache = registered_caches; cache != NULL; cache = cache->next) {
+        mem_dealloc(cache->counts, counts_size);
+        cache->counts = NULL;
+    }
+    registered_caches = NULL;
+    mem_dealloc(retired_counts, counts_size);
+    retired_counts = NULL;
+    counts_size = 0U;
+    pthread_mutex_unlock(&stats_lock);
+
+    // Slabs of the caches left are spans of the heaps and go with them
+    pthread_mutex_lock(&caches_lock);
+    while (live_caches != NULL) {
+        object_cache *cache = live_caches;
+        live_caches = cache->next;
+        for (size_t i = 0U; i < cache->nodes; i++) pthread_mutex_destroy(&cache->node[i].lock);
+        mem_dealloc(cache, cache->map_size);
+    }
+    for (size_t slot = 0U; slot < OBJECT_CACHE_MAGAZINES; slot++) object_caches[slot] = NULL;
+    pthread_mutex_unlock(&caches_lock);
+
+    for (size_t i = 0U; i < nodes; i++) {
+	numa_heap *heap = numa_heaps[i];
+
+	large_unmap_all(heap->large_cache);
+	heap->large_cache = NULL;
+
+	// Large objects the program never freed live outside the heap's reservation
+	large_unmap_all(heap->large_runs);
+	heap->large_runs = NULL;
+
+	// The first page of every span, in use or free, leads to its descriptor
+	char *addr = (char *) heap->start_addr;
+	while (addr < (char *) heap->start_addr + heap->used_size) {
+	    span *carved = pagemap_lookup(addr);
+	    addr += carved->size;
+	    span_release(carved);
+	}
+
+	if (heap->start_addr != NULL) mem_dealloc(heap->start_addr, heap->reserved_size);
+
+	for (size_t bin = 0U; bin < BINS; bin++) pthread_mutex_destroy(&heap->bins[bin].lock);
+	pthread_mutex_destroy(&heap->lock);
+	mem_dealloc(heap->spills, nodes * (sizeof(size_t) + sizeof(unsigned)));
+	mem_dealloc(heap, sizeof(numa_heap));
+    }
+
+    mem_dealloc(numa_heaps, nodes * sizeof(numa_heap *));
+    numa_heaps = NULL;
+    pagemap_free();
+    free_numa_topology();
+}
+
+/*
+ * The page map tells which node and bin the block came from, so it goes back to exactly
+ * the free list it was taken from. Pointers the allocator does not own are ignored.
+ */
+void deallocate(void *ptr) {
+    assert(ptr != NULL);
+
+    span *owner = pagemap_lookup(ptr);
+    if (owner == NULL || owner->bin == FREE_BIN) return;
+
+    if (owner->bin == LARGE_BIN) {
+        large_free(owner);
+        return;
+    }
+
+    if (owner->bin == CACHE_BIN) {
+        object_cache_free(owner->cache, ptr);
+        return;
+    }
+
+    int node = owner->node;
+    size_t bin_index = owner->bin;
+    free_block *to_free = (free_block *) ptr;
+
+    if (tcache.node == -1) {
+        int cpu_node = numa_node_of_cpu(sched_getcpu());
+        if (cpu_node != -1) tcache_bind(cpu_node);
+    }
+
+    thread_count(node, bin_index, COUNT_FREES, 1);
+
+    if (tcache.exited) {
+        numa_heap *heap = numa_heaps[node];
+
+        bin_lock(heap, bin_index);
+        heap_put_block(heap, to_free);
+        pthread_mutex_unlock(&heap->bins[bin_index].lock);
+        return;
+    }
+
+    // Blocks of the thread's home node stay in its cache, others are queued for their node
+    if (node == tcache.node) {
+        tcache_bin *bin = &tcache.bins[bin_index];
+        to_free->next = bin->head;
+        bin->head = to_free;
+        size_t batch = tcache_batch(bin_index);
+        if (++bin->count > 2 * batch) tcache_flush_bin(&tcache, bin_index, batch);
+        return;
+    }
+
+    thread_count(node, bin_index, COUNT_REMOTE_FREES, 1);
+    emulate_remote_access(tcache.node, node);
+    heap_push_remote(numa_heaps[node], bin_index, to_free);
+}
+
+/*
+ * Object caches. Every node has a list of partial slabs and one of full slabs per cache,
+ * a slab being a span of CACHE_BIN cut in objects `stride` bytes apart. Threads keep the
+ * objects of their node in the magazine of the cache's slot and move them to and from
+ * the slabs `batch` at a time, under the lock of the node's lists.
+ */
+static inline void **object_link(const object_cache *cache, void *object) {
+    return (void **) ((char *) object + cache->link_offset);
+}
+
+static inline int slab_is_full(const object_cache *cache, const span *slab) {
+    return slab->free_list == NULL && slab->bump_ptr + cache->stride > (char *) slab->start + slab->size;
+}
+
+/*
+ * Takes a slab from the node's heap and files it under the node's partial slabs. The
+ * caller must hold the lock of the node's lists.
+ */
+static span *slab_new(object_cache *cache, unsigned node) {
+    numa_heap *heap = numa_heaps[node];
+    heap_lock(heap);
+
+    span *slab = heap_alloc_pages(heap, cache->slab_size);
+    if (slab == NULL) {
+        pthread_mutex_unlock(&heap->lock);
+        return NULL;
+    }
+
+    slab->bin = CACHE_BIN;
+    slab->interleaved = 0;
+    slab->free_list = NULL;
+    slab->bump_ptr = slab->start;
+    slab->used = 0U;
+    slab->cache = cache;
+
+    if (pagemap_set(slab->start, slab->size, slab) != 0) {
+        heap_free_pages(heap, slab);
+        pthread_mutex_unlock(&heap->lock);
+        return NULL;
+    }
+
+    pthread_mutex_unlock(&heap->lock);
+
+    span_list_push(&cache->node[node].slabs, slab);
+    return slab;
+}
+
+/*
+ * Gives a detached slab back to its heap, after running the dtor over every object ever
+ * carved from it.
+ */
+static void slab_release(object_cache *cache, span *slab) {
+    if (cache->dtor != NULL) {
+        for (char *object = slab->start; object < slab->bump_ptr; object += cache->stride) {
+            cache->dtor(object, cache->arg);
+        }
+    }
+
+    numa_heap *heap = numa_heaps[slab->node];
+    heap_lock(heap);
+    heap_free_pages(heap, slab);
+    pthread_mutex_unlock(&heap->lock);
+    heap_maybe_purge(heap);
+}
+
+/*
+ * Detaches up to `max` objects from the node's slabs, recycled ones first and then fresh
+ * ones carved from a slab's bump pointer, which is when the ctor runs. The objects are
+ * returned linked in *out, the caller must hold the lock of the node's lists. Returns
+ * the number of objects detached.
+ */
+static size_t slab_take(object_cache *cache, unsigned node, size_t max, void **out) {
+    object_cache_node *lists = &cache->node[node];
+    void *first = NULL;
+    void *tail = NULL;
+    size_t taken = 0U;
+
+    while (taken < max) {
+        span *slab = lists->slabs;
+        if (slab == NULL && (slab = slab_new(cache, node)) == NULL) break;
+
+        while (taken < max) {
+            void *object;
+
+            if (slab->free_list != NULL) {
+                object = slab->free_list;
+                slab->free_list = *object_link(cache, object);
+            } else if (slab->bump_ptr + cache->stride <= (char *) slab->start + slab->size) {
+                object = slab->bump_ptr;
+                slab->bump_ptr += cache->stride;
+                if (cache->ctor != NULL) cache->ctor(object, cache->arg);
+            } else {
+                break;
+            }
+
+            slab->used++;
+            if (tail == NULL) first = object;
+            else *object_link(cache, tail) = object;
+            tail = object;
+            taken++;
+        }
+
+        if (slab_is_full(cache, slab)) {
+            span_list_remove(&lists->slabs, slab);
+            span_list_push(&lists->full, slab);
+        }
+    }
+
+    if (tail != NULL) *object_link(cache, tail) = NULL;
+    *out = first;
+
+    return taken;
+}
+
+/*
+ * Returns the linked objects of one node to their slabs under a single acquisition of
+ * the node's lock. Slabs left empty go back to the heap, except the last one of the node,
+ * once the lock is dropped.
+ */
+static void slab_put_objects(object_cache *cache, unsigned node, void *objects) {
+    object_cache_node *lists = &cache->node[node];
+    span *emptied = NULL;
+
+    pthread_mutex_lock(&lists->lock);
+
+    while (objects != NULL) {
+        void *next = *object_link(cache, objects);
+        span *slab = pagemap_lookup(objects);
+
+        if (slab_is_full(cache, slab)) {
+            span_list_remove(&lists->full, slab);
+            span_list_push(&lists->slabs, slab);
+        }
+
+        *object_link(cache, objects) = slab->free_list;
+        slab->free_list = objects;
+
+        if (--slab->used == 0 && (slab->prev != NULL || slab->next != NULL)) {
+            span_list_remove(&lists->slabs, slab);
+            slab->next = emptied;
+            emptied = slab;
+        }
+
+        objects = next;
+    }
+
+    pthread_mutex_unlock(&lists->lock);
+
+    while (emptied != NULL) {
+        span *next = emptied->next;
+        slab_release(cache, emptied);
+        emptied = next;
+    }
+}
+
+/*
+ * Takes a single object from the nodes nearest to `node` once its own heap ran dry.
+ */
+static void *object_cache_spill(object_cache *cache, int node) {
+    numa_heap *local = numa_heaps[node];
+
+    for (size_t i = 0U; i < local->spill_nodes; i++) {
+        unsigned target = local->spill_order[i];
+        void *object;
+
+        emulate_remote_access(node, (int) target);
+        pthread_mutex_lock(&cache->node[target].lock);
+        size_t got = slab_take(cache, target, 1, &object);
+        pthread_mutex_unlock(&cache->node[target].lock);
+
+        if (got == 0) continue;
+
+        __atomic_fetch_add(&local->spills[target], 1, __ATOMIC_RELAXED);
+        thread_count(target, CACHE_ROW, COUNT_ALLOCS, 1);
+        return object;
+    }
+
+    return NULL;
+}
+
+/*
+ * The thread's magazine for the cache, emptied first when it still holds objects of a
+ * destroyed cache that had the slot before. Those went away with their slabs.
+ */
+static object_magazine *magazine_of(object_cache *cache) {
+    object_magazine *magazine = &tcache.magazines[cache->magazine];
+
+    if (magazine->generation != cache->generation) {
+        magazine->generation = cache->generation;
+        magazine->head = NULL;
+        magazine->count = 0U;
+    }
+
+    return magazine;
+}
+
+/*
+ * Moves up to `count` objects from the head of a magazine back to the slabs of the
+ * cache's home node.
+ */
+static void magazine_flush(thread_cache *cache, size_t slot, size_t count) {
+    object_magazine *magazine = &cache->magazines[slot];
+    if (magazine->head == NULL || count == 0) return;
+
+    object_cache *owner = __atomic_load_n(&object_caches[slot], __ATOMIC_ACQUIRE);
+    if (owner == NULL || owner->generation != magazine->generation) {
+        magazine->head = NULL;
+        magazine->count = 0U;
+        return;
+    }
+
+    void *first = magazine->head;
+    void *tail = first;
+    size_t moved = 1U;
+
+    while (moved < count && *object_link(owner, tail) != NULL) {
+        tail = *object_link(owner, tail);
+        moved++;
+    }
+
+    magazine->head = *object_link(owner, tail);
+    magazine->count -= moved;
+    *object_link(owner, tail) = NULL;
+
+    slab_put_objects(owner, (unsigned) cache->node, first);
+}
+
+/*
+ * Objects are laid out `stride` bytes apart, a multiple of the alignment. Without a ctor
+ * the free list link overlays the first word of a free object, with one it follows the
+ * object so the constructed state survives. The first OBJECT_CACHE_MAGAZINES caches get
+ * a magazine in every thread cache, later ones take their node's lock on every call.
+ */
+object_cache *object_cache_create_ctor(size_t size, size_t align, object_hook ctor, object_hook dtor, void *arg) {
+    if (numa_heaps == NULL) {
+        fprintf(stderr, "Object caches need an initialized allocator\n");
+        return NULL;
+    }
+
+    if (size == 0 || align == 0 || (align & (align - 1)) != 0 || align > system_page_size) {
+        fprintf(stderr, "Invalid object cache size %zu or alignment %zu\n", size, align);
+        return NULL;
+    }
+
+    size_t word = sizeof(void *);
+    if (align < word) align = word;
+
+    size_t link_offset = ctor != NULL ? (size + word - 1) & ~(word - 1) : 0U;
+    size_t raw = ctor != NULL ? link_offset + word : (size > word ? size : word);
+    size_t stride = (raw + align - 1) & ~(align - 1);
+
+    size_t slab_size = SPAN_MIN_BLOCKS * stride;
+    if (slab_size < SPAN_MIN_SIZE) slab_size = SPAN_MIN_SIZE;
+    slab_size = (slab_size + system_page_size - 1) & ~(system_page_size - 1);
+
+    size_t nodes = nodes_num;
+    size_t header = (sizeof(object_cache) + CACHE_LINE_SIZE - 1) & ~(size_t) (CACHE_LINE_SIZE - 1);
+    size_t map_size = header + nodes * sizeof(object_cache_node);
+
+    object_cache *cache = (object_cache *) mem_alloc(map_size);
+    if (cache == NULL) return NULL;
+
+    size_t batch = TCACHE_BATCH_BYTES / stride;
+    if (batch > TCACHE_BATCH) batch = TCACHE_BATCH;
+
+    cache->size = size;
+    cache->stride = stride;
+    cache->link_offset = link_offset;
+    cache->slab_size = slab_size;
+    cache->batch = batch > 0 ? batch : 1;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->arg = arg;
+    cache->magazine = -1;
+    cache->nodes = nodes;
+    cache->map_size = map_size;
+    cache->node = (object_cache_node *) ((char *) cache + header);
+
+    for (size_t i = 0U; i < nodes; i++) {
+        pthread_mutex_init(&cache->node[i].lock, NULL);
+        cache->node[i].slabs = NULL;
+        cache->node[i].full = NULL;
+    }
+
+    pthread_mutex_lock(&caches_lock);
+    cache->generation = ++cache_generations;
+    for (size_t slot = 0U; slot < OBJECT_CACHE_MAGAZINES; slot++) {
+        if (object_caches[slot] != NULL) continue;
+
+        cache->magazine = (int) slot;
+        __atomic_store_n(&object_caches[slot], cache, __ATOMIC_RELEASE);
+        break;
+    }
+    cache->next = live_caches;
+    live_caches = cache;
+    pthread_mutex_unlock(&caches_lock);
+
+    return cache;
+}
+
+object_cache *object_cache_create(size_t size, size_t align) {
+    return object_cache_create_ctor(size, align, NULL, NULL, NULL);
+}
+
+void *object_cache_alloc(object_cache *cache) {
+    int node = numa_node_of_cpu(sched_getcpu());
+    if (node == -1) return NULL;
+
+    if (cache->magazine == -1 || tcache_bind(node) != 0) {
+        void *object;
+
+        pthread_mutex_lock(&cache->node[node].lock);
+        size_t got = slab_take(cache, (unsigned) node, 1, &object);
+        pthread_mutex_unlock(&cache->node[node].lock);
+
+        if (got == 0) return object_cache_spill(cache, node);
+
+        thread_count((unsigned) node, CACHE_ROW, COUNT_ALLOCS, 1);
+        return object;
+    }
+
+    object_magazine *magazine = magazine_of(cache);
+
+    if (magazine->head == NULL) {
+        void *first;
+
+        pthread_mutex_lock(&cache->node[node].lock);
+        size_t got = slab_take(cache, (unsigned) node, cache->batch, &first);
+        pthread_mutex_unlock(&cache->node[node].lock);
+
+        // Spilled objects belong to another node and bypass the magazine
+        if (got == 0) return object_cache_spill(cache, node);
+
+        magazine->head = first;
+        magazine->count = got;
+    }
+
+    void *object = magazine->head;
+    magazine->head = *object_link(cache, object);
+    magazine->count--;
+
+    thread_count((unsigned) node, CACHE_ROW, COUNT_ALLOCS, 1);
+    return object;
+}
+
+/*
+ * Objects of the thread's node go to its magazine, others straight back to their slab.
+ */
+void object_cache_free(object_cache *cache, void *object) {
+    assert(object != NULL);
+
+    span *slab = pagemap_lookup(object);
+    if (slab == NULL || slab->bin != CACHE_BIN || slab->cache != cache) {
+        fprintf(stderr, "Object %p does not belong to the cache\n", object);
+        return;
+    }
+
+    if (tcache.node == -1) {
+        int cpu_node = numa_node_of_cpu(sched_getcpu());
+        if (cpu_node != -1) tcache_bind(cpu_node);
+    }
+
+    thread_count(slab->node, CACHE_ROW, COUNT_FREES, 1);
+
+    if (cache->magazine != -1 && (int) slab->node == tcache.node) {
+        object_magazine *magazine = magazine_of(cache);
+
+        *object_link(cache, object) = magazine->head;
+        magazine->head = object;
+        if (++magazine->count > 2 * cache->batch) magazine_flush(&tcache, (size_t) cache->magazine, cache->batch);
+        return;
+    }
+
+    if ((int) slab->node != tcache.node) {
+        thread_count(slab->node, CACHE_ROW, COUNT_REMOTE_FREES, 1);
+        emulate_remote_access(tcache.node, (int) slab->node);
+    }
+
+    *object_link(cache, object) = NULL;
+    slab_put_objects(cache, slab->node, object);
+}
+
+/*
+ * Runs the dtor over every object the cache carved and gives all its slabs back. Only
+ * the calling thread's magazine is flushed, those of other threads are emptied lazily
+ * when they next touch the slot.
+ */
+void object_cache_destroy(object_cache *cache) {
+    if (cache == NULL) return;
+
+    if (cache->magazine != -1) {
+        tcache.magazines[cache->magazine].head = NULL;
+        tcache.magazines[cache->magazine].count = 0U;
+    }
+
+    pthread_mutex_lock(&caches_lock);
+    if (cache->magazine != -1) __atomic_store_n(&object_caches[cache->magazine], NULL, __ATOMIC_RELEASE);
+    for (object_cache **link = &live_caches; *link != NULL; link = &(*link)->next) {
+        if (*link != cache) continue;
+
+        *link = cache->next;
+        break;
+    }
+    pthread_mutex_unlock(&caches_lock);
+
+    for (size_t i = 0U; i < cache->nodes; i++) {
+        span *lists[] = { cache->node[i].slabs, cache->node[i].full };
+
+        for (size_t list = 0U; list < 2; list++) {
+            for (span *slab = lists[list]; slab != NULL;) {
+                span *next = slab->next;
+                slab_release(cache, slab);
+                slab = next;
+            }
+        }
+
+        pthread_mutex_destroy(&cache->node[i].lock);
+    }
+
+    mem_dealloc(cache, cache->map_size);
+}
@@ -5,34 +5,286 @@
 #include <pthread.h>
 
 #define BINS 12
+#define LARGE_BIN BINS      // bin of spans that hold a single object above the biggest bin
+#define FREE_BIN (BINS + 1) // bin of free page runs in a node heap
+#define CACHE_BIN (BINS + 2) // bin of slabs of an object cache
+#define FREE_SPAN_LISTS 128 // free runs of 1 to 126 pages have a list per size, longer ones share the last
 
+/*
+ * How a node heap picks the memory it hands out. segregated_free_lists refills a bin
+ * from the span it used last and takes pages from the free list of the exact size.
+ * best_fit_within_a_bin refills from the fullest span with room left, so lightly used
+ * spans drain and go back to the page heap. address_ordered_first_fit refills from the
+ * lowest span and takes the lowest free pages that fit, packing the heap towards its
+ * start.
+ */
 typedef enum {
     segregated_free_lists,
     best_fit_within_a_bin,
+    address_ordered_first_fit,
 } allocation_policy;
 
+/*
+ * Pages backing the node heaps. Huge page backings fall back to the next one down when
+ * the system cannot provide them, numa_heap::backing tells what a heap actually got.
+ */
+typedef enum {
+    base_pages,
+    transparent_huge_pages,
+    hugetlbfs_pages,
+} page_backing;
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+/*
+ * Free blocks are linked through their own first word, so a free block costs no memory
+ * besides itself. The size of a block is implied by the bin it sits in.
+ */
 typedef struct free_block {
-    void *starting_addr;
-    size_t size;
     struct free_block *next;
 } free_block;
 
+/*
+ * A span is a page aligned run of memory owned by one node. Spans of small blocks hold
+ * blocks of a single bin, the page map points every page of a span in use at its
+ * descriptor. Free spans of a heap are only reachable through their first and last page.
+ */
+typedef struct span {
+    void *start;
+    size_t size;
+    unsigned node;
+    unsigned bin;
+    unsigned interleaved; // large run whose pages are spread over all nodes
+    unsigned purged;      // free or cached run whose pages were given back to the OS
+    unsigned long freed_at; // ms on the monotonic clock, free and cached runs only
+    struct span *next;
+    struct span *prev;
+
+    // Spans of small blocks and object cache slabs only
+    free_block *free_list;
+    char *bump_ptr; // next never handed out block
+    size_t used;    // blocks handed out of the span
+    struct object_cache *cache; // owner of a slab
+} span;
+
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Central state of one size class of a node heap. Every bin has its own lock on its own
+ * cache line, so refills of different size classes do not wait for each other.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    span *spans;             // spans with blocks left to hand out
+    free_block *remote_free; // blocks freed by threads of other nodes, pushed without the lock
+    size_t lock_acquisitions;      // both counted under the lock
+    size_t contended_acquisitions; // acquisitions that found the lock taken
+} __attribute__((aligned(CACHE_LINE_SIZE))) heap_bin;
+
+/*
+ * A node heap reserves max_heap_size of address space up front and commits it in
+ * chunk_size steps as it runs out of free spans. Bins get spans carved from the heap,
+ * splitting bigger free spans when needed, and give them back once all their blocks
+ * are free, where they coalesce with free neighbours.
+ *
+ * Each bin is guarded by its own lock, the page heap (free spans, the frontier, the large
+ * cache and the purger state) by numa_heap::lock. A bin lock may be held while taking
+ * the page heap lock, never the other way round.
+ */
 typedef struct {
     void *start_addr;
-    size_t heap_size;
+    size_t reserved_size; // address space reserved for the heap
+    size_t heap_size;     // committed prefix of the reservation
+    size_t used_size;     // end of the part of the heap ever carved into spans
     unsigned numa_node;
-    free_block *free_list[BINS];
-    pthread_mutex_t lock;
+    page_backing backing;
+    allocation_policy policy;
+    heap_bin bins[BINS];
+    span *free_spans[FREE_SPAN_LISTS];
+    span *large_cache; // freed large spans kept mapped for reuse
+    span *large_runs;  // large spans handed out, unmapped by free_allocator() if still live
+    size_t large_cached_bytes;
+    size_t bin_span_bytes; // pages handed to the bins
+    pthread_mutex_t lock __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t lock_acquisitions;
+    size_t contended_acquisitions;
+
+    // Large objects, counted with atomics since runs are mapped without the lock
+    size_t large_allocs;
+    size_t large_frees;
+    size_t large_remote_frees;
+    size_t large_bytes; // bytes of large runs handed out and not freed yet
+
+    // Remote frees of all bins, pushed without a lock and drained in batches
+    size_t remote_frees;         // blocks pushed onto a bin's remote_free
+    size_t remote_drains;        // batches moved from remote_free to the free lists
+    size_t remote_drained_blocks;
+
+    // Free memory idle for purge_decay_ms goes back to the OS, the node binding stays
+    size_t purged_bytes;  // bytes of free spans and cached large runs currently purged
+    size_t tail_resident; // bytes right past the carved frontier that may be resident
+    size_t tail_purged;   // purged bytes following those, before never touched ones
+    unsigned long tail_freed_at;
+    unsigned long last_purge;
+    size_t purges;        // madvise calls made by the purger
+
+    // Other nodes to take blocks from once the heap is exhausted, nearest first
+    unsigned *spill_order;
+    size_t spill_nodes;
+    size_t *spills; // spills[node]: blocks this node's threads got from `node`
 } numa_heap;
 
+#define ALLOC_DEFAULT_MAX_HEAP_SIZE (16UL * 1024 * 1024 * 1024)
+#define ALLOC_DEFAULT_CHUNK_SIZE (1024UL * 1024)
+#define ALLOC_DEFAULT_PURGE_DECAY_MS 10000
+
+/*
+ * heap_size is committed and faulted in on every node during init when prefault is set,
+ * otherwise heaps start empty and grow by chunk_size on demand up to max_heap_size.
+ * Zero fields take the ALLOC_DEFAULT_* values, max_heap_size never drops below heap_size.
+ * With huge_pages set chunks are whole huge pages. hugetlbfs_pages takes max_heap_size
+ * per node out of the hugetlb pool at init, so it is meant for an explicit max_heap_size.
+ * Allocations whose local heap is exhausted spill to other nodes in increasing distance
+ * order; max_spill_distance caps how remote those nodes may be, 0 allows any distance and
+ * a negative value turns spilling off.
+ * Free memory that stayed idle for purge_decay_ms is released with MADV_DONTNEED, or with
+ * MADV_FREE when purge_lazy is set, on the allocation and free slow paths; a negative
+ * purge_decay_ms keeps it resident.
+ * emulate_nodes > 0 lays that many virtual nodes over the machine, with the
+ * emulate_nodes * emulate_nodes emulate_distance matrix (NULL for a ring) and
+ * emulate_delay_ns spun on every access to another node's heap; see numa_emulation.
+ * Left at 0 the NUMA_EMULATE_NODES environment variable can ask for it instead.
+ * policy is the allocation_policy of every node heap, node_policies an array with one
+ * per node that overrides it; NUMA_ALLOC_POLICY (segregated, best_fit, address_ordered)
+ * sets it when both are left unset.
+ * stats_signal installs a handler that prints get_allocator_stats() to stderr whenever
+ * the process gets that signal, stats_at_exit prints them when it exits. Left at 0 they
+ * are taken from NUMA_ALLOC_STATS_SIGNAL and NUMA_ALLOC_STATS_AT_EXIT.
+ */
+typedef struct {
+    size_t heap_size;
+    size_t max_heap_size;
+    size_t chunk_size;
+    int prefault;
+    page_backing huge_pages;
+    int max_spill_distance;
+    long purge_decay_ms;
+    int purge_lazy;
+    size_t emulate_nodes;
+    const int *emulate_distance;
+    unsigned emulate_delay_ns;
+    int stats_signal;
+    int stats_at_exit;
+    allocation_policy policy;
+    const allocation_policy *node_policies;
+} allocator_config;
+
+/*
+ * Counters of one bin of a node heap, bins[LARGE_BIN] of allocator_node_stats covers
+ * the large objects. Allocations and frees are counted against the node that owns the
+ * memory, whichever thread made them; remote_frees are the frees made by threads of
+ * other nodes. bytes_in_use is what the program holds, free_bytes what the bin could
+ * hand out without new pages (the run cache for large objects). Blocks sitting in
+ * thread caches count as neither. object_caches of allocator_node_stats sums up all
+ * object caches, their slabs split into bytes_in_use and free_bytes.
+ */
+typedef struct {
+    size_t allocations;
+    size_t frees;
+    size_t remote_frees;
+    size_t bytes_in_use;
+    size_t free_bytes;
+    size_t lock_acquisitions;
+    size_t contended_acquisitions;
+} allocator_bin_stats;
+
+/*
+ * stranded_bytes are free blocks in spans that still hold objects, memory neither the
+ * other bins nor the OS can get back. span_fragmentation is their share of the bins'
+ * spans, page_fragmentation how scattered the free page runs are, 1 - the
+ * largest run / all of them. Both are 0 for a perfectly packed heap.
+ */
+typedef struct {
+    allocator_bin_stats bins[BINS + 1];
+    allocator_bin_stats object_caches;
+    size_t committed_bytes;
+    size_t free_bytes;   // free spans and the committed part never carved
+    size_t free_span_bytes;
+    size_t largest_free_span;
+    size_t bin_span_bytes;
+    size_t stranded_bytes;
+    double span_fragmentation;
+    double page_fragmentation;
+    size_t purged_bytes;
+    size_t spills;       // blocks this node's threads took from other nodes
+    size_t lock_acquisitions; // of the page heap lock
+    size_t contended_acquisitions;
+} allocator_node_stats;
+
+/*
+ * Snapshot taken by get_allocator_stats() without stopping the allocator, counters
+ * that change while it is taken may be off by the operations in flight. total sums up
+ * the nodes.
+ */
+typedef struct {
+    size_t nodes_num;
+    allocator_node_stats *nodes;
+    allocator_node_stats total;
+} allocator_stats;
 
 void init_allocator(size_t heap_size);
+int init_allocator_with_config(const allocator_config *config);
 void free_allocator(void);
 
 void *allocate_localy(size_t size);
 void *allocate_interleaved(size_t size);
+void *allocate_on_node(int node, size_t size);
+void *allocate_near(const void *ptr, size_t size);
+int node_of(const void *ptr);
 
 void deallocate(void *ptr);
 
+size_t allocate_batch(size_t size, size_t count, void **out);
+void deallocate_batch(void **ptrs, size_t count);
+
+size_t get_allocation_size(const void *ptr);
+void purge_allocator(void);
+
+/*
+ * fork() handlers, for programs that fork while other threads allocate:
+ * pthread_atfork(allocator_fork_prepare, allocator_fork_parent, allocator_fork_child).
+ * Without them a child forked while a lock was held deadlocks on its first allocation.
+ */
+void allocator_fork_prepare(void);
+void allocator_fork_parent(void);
+void allocator_fork_child(void);
+size_t get_heap_resident_bytes(unsigned node);
+size_t get_heap_purged_bytes(unsigned node);
+size_t get_spill_count(unsigned from, unsigned to);
+page_backing get_heap_backing(unsigned node);
+allocation_policy get_heap_policy(unsigned node);
+allocator_stats *get_allocator_stats(void);
+void free_allocator_stats(allocator_stats *stats);
+const char *page_backing_name(page_backing backing);
+const char *allocation_policy_name(allocation_policy policy);
+
+/*
+ * Object caches hand out objects of one size from node-local slabs cut to exactly that
+ * size, for hot fixed-size types the power of two bins would round up. With a ctor,
+ * objects are constructed once when their slab is carved and stay constructed while
+ * free, so alloc returns them as free left them; dtor runs when the slab goes back to
+ * the heap. Objects may also be freed with deallocate(). Destroying a cache frees the
+ * objects still allocated from it, free_allocator() drops the caches left without
+ * running their dtor.
+ */
+typedef struct object_cache object_cache;
+typedef void (*object_hook)(void *object, void *arg);
+
+object_cache *object_cache_create(size_t size, size_t align);
+object_cache *object_cache_create_ctor(size_t size, size_t align, object_hook ctor, object_hook dtor, void *arg);
+void *object_cache_alloc(object_cache *cache);
+void object_cache_free(object_cache *cache, void *object);
+void object_cache_destroy(object_cache *cache);
+
 #endif
 
@@ -60,6 +60,26 @@ void *thread_alloc_work(void *arg) {
     return NULL;
 }
 
+void *thread_interleaved_work(void *arg) {
+    size_t alloc_size = *(size_t *)arg;
+
+    for (int i = 0; i < NUM_ITERATIONS; i++) {
+        void *ptr = allocate_interleaved(alloc_size);
+        deallocate(ptr);
+    }
+    return NULL;
+}
+
+void *thread_malloc_work(void *arg) {
+    size_t alloc_size = *(size_t *)arg;
+
+    for (int i = 0; i < NUM_ITERATIONS; i++) {
+        void *ptr = malloc(alloc_size);
+        free(ptr);
+    }
+    return NULL;
+}
+
 void benchmark_throughput(size_t alloc_size) {
     printf("Benchmarking Throughput with %d Threads and Allocations of Size %zu Bytes:\n", NUM_THREADS, alloc_size);
 
@@ -79,7 +99,7 @@ void benchmark_throughput(size_t alloc_size) {
     // NUMA Interleaved Allocation
     start_time = get_time_ns();
     for (int i = 0; i < NUM_THREADS; i++) {
-        pthread_create(&threads[i], NULL, thread_alloc_work, &alloc_size);
+        pthread_create(&threads[i], NULL, thread_interleaved_work, &alloc_size);
     }
     for (int i = 0; i < NUM_THREADS; i++) {
         pthread_join(threads[i], NULL);
@@ -89,7 +109,7 @@ void benchmark_throughput(size_t alloc_size) {
     // Standard malloc
     start_time = get_time_ns();
     for (int i = 0; i < NUM_THREADS; i++) {
-        pthread_create(&threads[i], NULL, thread_alloc_work, &alloc_size);
+        pthread_create(&threads[i], NULL, thread_malloc_work, &alloc_size);
     }
     for (int i = 0; i < NUM_THREADS; i++) {
         pthread_join(threads[i], NULL);
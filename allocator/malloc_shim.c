@@ -0,0 +1,211 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "allocator.h"
+#include "pagemap.h"
+#include "util.h"
+
+/*
+ * malloc and friends on top of the node heaps, built as a shared library to be loaded
+ * with LD_PRELOAD in front of glibc. Every allocation is served from the heap of the
+ * node the calling thread runs on.
+ *
+ * The allocator itself needs malloc while it starts up (the topology is read with stdio),
+ * and nothing stops a library constructor from calling malloc before ours ran. So until
+ * the heaps are up, and whenever the allocator reenters malloc, requests go to glibc.
+ * Pointers the page map does not know are glibc's, they are freed and resized by glibc.
+ * Once the heaps are up, fork() takes every allocator lock first, so a child forked
+ * while other threads allocate does not inherit a lock nobody will release.
+ */
+
+#define SHIM_MIN_ALIGN 16
+#define SHIM_PAGE_SIZE ((size_t) 1 << PAGEMAP_PAGE_SHIFT)
+#define SHIM_HEAP_SIZE (64UL * 1024 * 1024)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+enum { shim_uninitialized, shim_initializing, shim_ready, shim_failed };
+
+static int shim_state = shim_uninitialized;
+static __thread int shim_busy; // set while the thread is inside the allocator
+
+/*
+ * First caller initializes the heaps, concurrent callers wait for it. Returns whether
+ * the heaps can be used by this call.
+ */
+static int shim_init(void) {
+    int state = __atomic_load_n(&shim_state, __ATOMIC_ACQUIRE);
+    if (state == shim_ready) return 1;
+    if (state == shim_failed || shim_busy) return 0;
+
+    int expected = shim_uninitialized;
+    if (__atomic_compare_exchange_n(&shim_state, &expected, shim_initializing, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        allocator_config config = { .heap_size = SHIM_HEAP_SIZE };
+        const char *max_heap_size = getenv("NUMA_ALLOC_MAX_HEAP_SIZE");
+        if (max_heap_size != NULL) config.max_heap_size = strtoull(max_heap_size, NULL, 0);
+
+        shim_busy = 1;
+        int failed = init_allocator_with_config(&config) != 0;
+        if (!failed) pthread_atfork(allocator_fork_prepare, allocator_fork_parent, allocator_fork_child);
+        shim_busy = 0;
+
+        __atomic_store_n(&shim_state, failed ? shim_failed : shim_ready, __ATOMIC_RELEASE);
+        return !failed;
+    }
+
+    while ((state = __atomic_load_n(&shim_state, __ATOMIC_ACQUIRE)) == shim_initializing) sched_yield();
+
+    return state == shim_ready;
+}
+
+__attribute__((constructor))
+static void shim_constructor(void) {
+    shim_init();
+}
+
+static void *shim_alloc(size_t size) {
+    if (!shim_init()) return __libc_malloc(size);
+    if (size == 0) size = 1;
+
+    shim_busy = 1;
+    void *ptr = allocate_localy(size);
+    shim_busy = 0;
+
+    // A thread the topology does not place on a node is still served
+    if (ptr == NULL) return __libc_malloc(size);
+
+    return ptr;
+}
+
+/*
+ * Blocks of a bin are aligned to their size up to the page size, so alignments up to a
+ * page only need a big enough bin. Larger alignments take a page run with room to slide
+ * the object to the boundary; freeing the inner pointer releases the whole run.
+ */
+static void *shim_aligned_alloc(size_t alignment, size_t size) {
+    if (alignment <= SHIM_MIN_ALIGN) return shim_alloc(size);
+    if (!shim_init()) return __libc_memalign(alignment, size);
+
+    size_t request = size > alignment ? size : alignment;
+    if (alignment > SHIM_PAGE_SIZE) {
+        if (size > SIZE_MAX - alignment) return NULL;
+
+        request = size + alignment - SHIM_PAGE_SIZE;
+        if (get_bin_index(request) < BINS) request = bin_size(BINS - 1) + 1;
+    }
+
+    shim_busy = 1;
+    char *ptr = (char *) allocate_localy(request);
+    shim_busy = 0;
+
+    if (ptr == NULL) return __libc_memalign(alignment, size);
+
+    return (void *) (((uintptr_t) ptr + alignment - 1) & ~(uintptr_t) (alignment - 1));
+}
+
+static int shim_owns(void *ptr) {
+    return __atomic_load_n(&shim_state, __ATOMIC_ACQUIRE) == shim_ready && pagemap_lookup(ptr) != NULL;
+}
+
+void *malloc(size_t size) {
+    void *ptr = shim_alloc(size);
+    if (ptr == NULL) errno = ENOMEM;
+
+    return ptr;
+}
+
+void free(void *ptr) {
+    if (ptr == NULL) return;
+
+    if (!shim_owns(ptr)) {
+        __libc_free(ptr);
+        return;
+    }
+
+    shim_busy = 1;
+    deallocate(ptr);
+    shim_busy = 0;
+}
+
+void *calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (!shim_init()) return __libc_calloc(count, size);
+
+    void *ptr = malloc(count * size);
+    if (ptr != NULL) memset(ptr, 0, count * size);
+
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) return malloc(size);
+
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    if (!shim_owns(ptr)) return __libc_realloc(ptr, size);
+
+    // Shrinking, or growing within the bin, keeps the block
+    size_t usable = get_allocation_size(ptr);
+    if (size <= usable && size > usable / 2) return ptr;
+
+    void *moved = malloc(size);
+    if (moved == NULL) return NULL;
+
+    memcpy(moved, ptr, size < usable ? size : usable);
+    free(ptr);
+
+    return moved;
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) return EINVAL;
+
+    void *ptr = shim_aligned_alloc(alignment, size);
+    if (ptr == NULL) return ENOMEM;
+
+    *out = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void *ptr = shim_aligned_alloc(alignment, size);
+    if (ptr == NULL) errno = ENOMEM;
+
+    return ptr;
+}
+
+size_t malloc_usable_size(void *ptr) {
+    static size_t (*libc_usable_size)(void *);
+
+    if (ptr == NULL) return 0;
+    if (shim_owns(ptr)) return get_allocation_size(ptr);
+
+    if (libc_usable_size == NULL) {
+        libc_usable_size = (size_t (*)(void *)) dlsym(RTLD_NEXT, "malloc_usable_size");
+        if (libc_usable_size == NULL) return 0;
+    }
+
+    return libc_usable_size(ptr);
+}
@@ -2,18 +2,37 @@
 #include <dirent.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "numa.h"
 
-int cpu_on_node[MAX_CPUS];
+// From <numaif.h>, so the allocator does not depend on libnuma
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
 
-size_t get_numa_nodes_num(void) {
+#define MASK_BITS (8 * sizeof(unsigned long))
+
+#define NODE_DIR "/sys/devices/system/node"
+
+numa_topology *current_topology = NULL;
+__thread int emulated_thread_node = -1;
+
+/*
+ * Counts the nodeN entries of the sysfs node directory, this is the only place that
+ * walks the filesystem for it, everything else reads the snapshot.
+ */
+static size_t scan_numa_nodes(void) {
     struct dirent **name_list;
     size_t num_nodes = 0;
 
-    int n = scandir("/sys/devices/system/node/", &name_list, NULL, alphasort);
+    int n = scandir(NODE_DIR, &name_list, NULL, alphasort);
 
-    if (n < 0) return -1;
+    if (n < 0) return 0;
 
     for (int i = 0; i < n; i++) {
         if (strncmp(name_list[i]->d_name, "node", 4) == 0) num_nodes++;
@@ -24,46 +43,411 @@ size_t get_numa_nodes_num(void) {
     return num_nodes;
 }
 
-void parse_cpu_list(const char *cpulist, int node, int *cpu_on_node) {
-    char *token;
-    char buffer[256];
-    strncpy(buffer, cpulist, sizeof(buffer) - 1);
+/*
+ * The highest possible CPU id plus one, which can be more than the number of CPUs
+ * when ids are sparse.
+ */
+static size_t scan_possible_cpus(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    FILE *file = fopen("/sys/devices/system/cpu/possible", "r");
+
+    if (file) {
+        char *line = NULL;
+        size_t length = 0;
+
+        if (getline(&line, &length, file) > 0) {
+            for (char *token = strtok(line, ","); token; token = strtok(NULL, ",")) {
+                int start, end;
+                int fields = sscanf(token, "%d-%d", &start, &end);
+
+                if (fields == 1) end = start;
+                if (fields >= 1 && end + 1 > cpus) cpus = end + 1;
+            }
+        }
+
+        free(line);
+        fclose(file);
+    }
+
+    return cpus > 0 ? (size_t) cpus : 1;
+}
+
+/*
+ * Reads a whole sysfs line however long it is, cpulists of big machines do not fit a
+ * fixed buffer. The caller frees the line.
+ */
+static char *read_node_file(size_t node, const char *name) {
+    char path[128];
+    snprintf(path, sizeof(path), NODE_DIR "/node%zu/%s", node, name);
+
+    FILE *file = fopen(path, "r");
+    if (!file) return NULL;
+
+    char *line = NULL;
+    size_t length = 0;
+    if (getline(&line, &length, file) < 0) {
+        free(line);
+        line = NULL;
+    }
+
+    fclose(file);
+    return line;
+}
+
+static void parse_cpu_list(char *cpulist, int node, int *cpu_on_node, size_t cpus_num) {
+    char *token = strtok(cpulist, ",");
 
-    token = strtok(buffer, ",");
     while (token) {
         int start, end;
 
-        // Check for range (e.g., "0-3")
-        if (sscanf(token, "%d-%d", &start, &end) == 2) {
+        // Check for range (e.g., "0-3") or single CPU (e.g., "0")
+        int fields = sscanf(token, "%d-%d", &start, &end);
+        if (fields == 1) end = start;
+
+        if (fields >= 1) {
             for (int cpu = start; cpu <= end; cpu++) {
-                cpu_on_node[cpu] = node;
+                if (cpu >= 0 && (size_t) cpu < cpus_num) cpu_on_node[cpu] = node;
             }
         }
-        // Check for single CPU (e.g., "0")
-        else if (sscanf(token, "%d", &start) == 1) {
-            cpu_on_node[start] = node;
-        }
 
         token = strtok(NULL, ",");
     }
 }
 
-void parse_cpus_to_node(void) {
-    size_t node = 0U;
-    memset(cpu_on_node, -1, sizeof(cpu_on_node));
+/*
+ * Fills row `node` of the distance matrix. Nodes without a distance file get the
+ * usual ACPI values, 10 for local and 20 for remote.
+ */
+static void parse_distances(size_t node, int *row, size_t nodes_num) {
+    char *line = read_node_file(node, "distance");
+
+    for (size_t to = 0U; to < nodes_num; to++) row[to] = to == node ? 10 : 20;
+    if (!line) return;
+
+    char *cursor = line;
+    for (size_t to = 0U; to < nodes_num; to++) {
+        char *end;
+        long distance = strtol(cursor, &end, 10);
+
+        if (end == cursor) break;
+        row[to] = (int) distance;
+        cursor = end;
+    }
+
+    free(line);
+}
+
+/*
+ * Hands the CPUs of every real node round-robin to the virtual nodes whose memory it
+ * backs. Real nodes that back no virtual node, when emulating fewer nodes than there
+ * are, give their CPUs to node real % nodes.
+ */
+static void emulate_cpu_map(numa_topology *topology, size_t real_nodes) {
+    size_t nodes_num = topology->nodes_num;
+    size_t *handed = calloc(real_nodes, sizeof(size_t));
+    if (handed == NULL) return;
+
+    for (size_t cpu = 0U; cpu < topology->cpus_num; cpu++) {
+        int real = topology->cpu_on_node[cpu];
+        if (real < 0) continue;
+
+        size_t backed = (size_t) real < nodes_num ? (nodes_num - real + real_nodes - 1) / real_nodes : 0;
+        if (backed == 0) {
+            topology->cpu_on_node[cpu] = real % (int) nodes_num;
+            continue;
+        }
+
+        topology->cpu_on_node[cpu] = real + (int) (real_nodes * (handed[real]++ % backed));
+    }
+
+    free(handed);
+}
+
+/*
+ * Builds a snapshot in a single mapping, the CPU map, the distance matrix and the
+ * physical node map follow the header. Without emulation every node is its own
+ * physical node.
+ */
+static numa_topology *build_topology(size_t real_nodes, const numa_emulation *emulation) {
+    size_t nodes_num = emulation != NULL ? emulation->nodes : real_nodes;
+    size_t cpus_num = scan_possible_cpus();
+    size_t map_size = sizeof(numa_topology) + (cpus_num + nodes_num * nodes_num + nodes_num) * sizeof(int);
+
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap failed");
+        return NULL;
+    }
+
+    numa_topology *topology = (numa_topology *) map;
+    topology->nodes_num = nodes_num;
+    topology->cpus_num = cpus_num;
+    topology->cpu_on_node = (int *) (topology + 1);
+    topology->distance = topology->cpu_on_node + cpus_num;
+    topology->physical_node = topology->distance + nodes_num * nodes_num;
+    topology->emulated = emulation != NULL;
+    topology->remote_delay_ns = emulation != NULL ? emulation->remote_delay_ns : 0;
+    topology->map_size = map_size;
+    topology->retired = NULL;
+
+    memset(topology->cpu_on_node, -1, cpus_num * sizeof(int));
+
+    for (size_t node = 0U; node < real_nodes; node++) {
+        char *cpulist = read_node_file(node, "cpulist");
+        if (cpulist) {
+            parse_cpu_list(cpulist, (int) node, topology->cpu_on_node, cpus_num);
+            free(cpulist);
+        }
+
+        if (emulation == NULL) parse_distances(node, topology->distance + node * nodes_num, nodes_num);
+    }
+
+    for (size_t node = 0U; node < nodes_num; node++) {
+        topology->physical_node[node] = (int) (node % real_nodes);
+    }
+
+    if (emulation == NULL) return topology;
+
+    emulate_cpu_map(topology, real_nodes);
+
+    for (size_t from = 0U; from < nodes_num; from++) {
+        for (size_t to = 0U; to < nodes_num; to++) {
+            size_t hops = from > to ? from - to : to - from;
+            if (nodes_num - hops < hops) hops = nodes_num - hops;
+
+            topology->distance[from * nodes_num + to] = emulation->distance != NULL
+                ? emulation->distance[from * nodes_num + to]
+                : (hops == 0 ? 10 : (int) (10 + 10 * hops));
+        }
+    }
+
+    return topology;
+}
+
+/*
+ * Fills `emulation` from NUMA_EMULATE_NODES, NUMA_EMULATE_DISTANCE (nodes * nodes
+ * numbers, row by row) and NUMA_EMULATE_DELAY_NS. Returns 0 when emulation is not
+ * asked for, the distance matrix it returns is freed by the caller.
+ */
+static int emulation_from_env(numa_emulation *emulation) {
+    const char *nodes = getenv("NUMA_EMULATE_NODES");
+    if (nodes == NULL || strtoul(nodes, NULL, 10) == 0) return 0;
+
+    emulation->nodes = strtoul(nodes, NULL, 10);
+    emulation->distance = NULL;
+    emulation->remote_delay_ns = 0;
+
+    const char *delay = getenv("NUMA_EMULATE_DELAY_NS");
+    if (delay != NULL) emulation->remote_delay_ns = (unsigned) strtoul(delay, NULL, 10);
+
+    const char *list = getenv("NUMA_EMULATE_DISTANCE");
+    if (list == NULL || emulation->nodes > MAX_NODES) return 1;
+
+    size_t count = emulation->nodes * emulation->nodes;
+    int *distance = malloc(count * sizeof(int));
+    if (distance == NULL) return 1;
+
+    const char *cursor = list;
+    for (size_t i = 0U; i < count; i++) {
+        char *end;
+        cursor += strspn(cursor, " ,;");
+        distance[i] = (int) strtol(cursor, &end, 10);
+
+        if (end == cursor || distance[i] < 10) {
+            fprintf(stderr, "NUMA_EMULATE_DISTANCE needs %zu distances of at least 10, using the default\n", count);
+            free(distance);
+            return 1;
+        }
+        cursor = end;
+    }
+
+    emulation->distance = distance;
+    return 1;
+}
+
+/*
+ * Takes the snapshot every allocator query reads. Machines without the sysfs node
+ * directory are treated as a single node. An emulated topology is taken from
+ * `emulation` when it asks for nodes, otherwise from the NUMA_EMULATE_* environment.
+ */
+int init_numa_topology(const numa_emulation *emulation) {
+    if (current_topology != NULL) return 0;
+
+    size_t real_nodes = scan_numa_nodes();
+    if (real_nodes == 0) real_nodes = 1;
+    if (real_nodes > MAX_NODES) real_nodes = MAX_NODES;
+
+    numa_emulation from_env;
+    int emulate_env = (emulation == NULL || emulation->nodes == 0) && emulation_from_env(&from_env);
+    if (emulate_env) emulation = &from_env;
+    else if (emulation != NULL && emulation->nodes == 0) emulation = NULL;
+
+    if (emulation != NULL && emulation->nodes > MAX_NODES) {
+        fprintf(stderr, "Cannot emulate %zu NUMA nodes, at most %d\n", emulation->nodes, MAX_NODES);
+        if (emulate_env) free((int *) from_env.distance);
+        return -1;
+    }
+
+    numa_topology *topology = build_topology(real_nodes, emulation);
+    if (emulate_env) free((int *) from_env.distance);
+    if (topology == NULL) return -1;
+
+    __atomic_store_n(&current_topology, topology, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Re-reads the CPU to node map after CPUs went on or offline. The node count stays
+ * what it was at init since the heaps are laid out per node; readers that still hold
+ * the old snapshot keep using it, so it is only unmapped by free_numa_topology. An
+ * emulated topology keeps its distances and delay.
+ */
+int refresh_numa_topology(void) {
+    numa_topology *old = __atomic_load_n(&current_topology, __ATOMIC_ACQUIRE);
+    if (old == NULL) return init_numa_topology(NULL);
+
+    numa_emulation emulation = { old->nodes_num, old->distance, old->remote_delay_ns };
+    size_t real_nodes = old->emulated ? scan_numa_nodes() : old->nodes_num;
+    if (real_nodes == 0) real_nodes = 1;
+    if (real_nodes > MAX_NODES) real_nodes = MAX_NODES;
+
+    numa_topology *topology = build_topology(real_nodes, old->emulated ? &emulation : NULL);
+    if (topology == NULL) return -1;
+
+    topology->retired = old;
+    __atomic_store_n(&current_topology, topology, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void free_numa_topology(void) {
+    numa_topology *topology = __atomic_exchange_n(&current_topology, NULL, __ATOMIC_ACQ_REL);
+
+    while (topology != NULL) {
+        numa_topology *retired = topology->retired;
+        munmap(topology, topology->map_size);
+        topology = retired;
+    }
+}
+
+size_t get_numa_nodes_num(void) {
+    if (current_topology == NULL && init_numa_topology(NULL) != 0) return 0;
+
+    return current_topology->nodes_num;
+}
+
+int numa_distance(int from, int to) {
+    const numa_topology *topology = __atomic_load_n(&current_topology, __ATOMIC_ACQUIRE);
+    if (topology == NULL || from < 0 || to < 0) return -1;
+    if ((size_t) from >= topology->nodes_num || (size_t) to >= topology->nodes_num) return -1;
+
+    return topology->distance[from * topology->nodes_num + to];
+}
+
+/*
+ * Makes the calling thread count as running on `node` of an emulated topology whatever
+ * CPU it is on, for virtual nodes that got no CPU of their own. -1 goes back to the
+ * CPU's node. Fails on real topologies, where it would make remote memory look local.
+ */
+int emulate_thread_node(int node) {
+    const numa_topology *topology = __atomic_load_n(&current_topology, __ATOMIC_ACQUIRE);
+    if (topology == NULL || !topology->emulated) return -1;
+    if (node < -1 || node >= (int) topology->nodes_num) return -1;
+
+    emulated_thread_node = node;
+    return 0;
+}
+
+/*
+ * Spins for the injected cost of a thread on `from` touching the heap of `to`, nothing
+ * unless the topology is emulated with a remote delay.
+ */
+void emulate_remote_access(int from, int to) {
+    const numa_topology *topology = __atomic_load_n(&current_topology, __ATOMIC_ACQUIRE);
+    if (topology == NULL || topology->remote_delay_ns == 0 || from == to) return;
+
+    int distance = numa_distance(from, to);
+    if (distance <= 10) return;
+
+    long delay = (long) topology->remote_delay_ns * (distance - 10) / 10;
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000000L + now.tv_nsec - start.tv_nsec < delay);
+}
+
+/*
+ * Sets an MPOL_BIND memory policy on [addr, addr + size), every page of the range is
+ * placed on `node` whenever and by whichever thread it gets faulted in. Pages that are
+ * already present are left where they are. Emulated nodes bind to their physical node.
+ */
+int bind_memory(void *addr, size_t size, int node) {
+    const numa_topology *topology = __atomic_load_n(&current_topology, __ATOMIC_ACQUIRE);
+    unsigned long mask[MAX_NODES / MASK_BITS] = { 0 };
+    if (node < 0 || node >= MAX_NODES) return -1;
+
+    if (topology != NULL && (size_t) node < topology->nodes_num) node = topology->physical_node[node];
+
+    mask[node / MASK_BITS] |= 1UL << (node % MASK_BITS);
+
+    // The kernel reads maxnode - 1 bits of the mask
+    if (syscall(SYS_mbind, addr, size, MPOL_BIND, mask, MAX_NODES + 1, 0) < 0) {
+        perror("mbind failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Sets an MPOL_INTERLEAVE memory policy over nodes 0 to nodes - 1 on the range, its
+ * pages are spread round-robin over the nodes as they get faulted in. Emulated nodes
+ * spread them over the physical nodes behind them.
+ */
+int interleave_memory(void *addr, size_t size, size_t nodes) {
+    const numa_topology *topology = __atomic_load_n(&current_topology, __ATOMIC_ACQUIRE);
+    unsigned long mask[MAX_NODES / MASK_BITS] = { 0 };
+    if (nodes == 0 || nodes > MAX_NODES) return -1;
+
+    for (size_t node = 0U; node < nodes; node++) {
+        size_t physical = topology != NULL && node < topology->nodes_num ? (size_t) topology->physical_node[node] : node;
+        mask[physical / MASK_BITS] |= 1UL << (physical % MASK_BITS);
+    }
+
+    if (syscall(SYS_mbind, addr, size, MPOL_INTERLEAVE, mask, MAX_NODES + 1, 0) < 0) {
+        perror("mbind failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Node the page holding `addr` sits on, faulting it in if it was never touched. Under
+ * emulation that is the physical node, which is also the first virtual node it backs.
+ */
+int page_node(const void *addr) {
+    int node = -1;
 
-    for (;;) { 
-        char path[128];
-	snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/cpulist", node);
-        FILE *file = fopen(path, "r");
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR) < 0) {
+        perror("get_mempolicy failed");
+        return -1;
+    }
 
-	if (!file) break;
+    return node;
+}
 
-	char buffer[256];
-	if (fgets(buffer, sizeof(buffer), file)) {
-	    parse_cpu_list(buffer, node, cpu_on_node);
-	}
-	node++;
-	fclose(file);
+/*
+ * Asks the kernel where `count` pages are without moving them, move_pages in query
+ * mode. status[i] gets the node of pages[i] or a negative errno, -ENOENT for a page
+ * that was never faulted in.
+ */
+int query_page_nodes(void **pages, size_t count, int *status) {
+    if (syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) < 0) {
+        perror("move_pages failed");
+        return -1;
     }
+
+    return 0;
 }
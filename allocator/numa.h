@@ -1,12 +1,66 @@
 #ifndef NUMA
 #define NUMA
 
-#define MAX_CPUS 256
+#include <stddef.h>
 
-extern int cpu_on_node[MAX_CPUS];
+#define MAX_NODES 1024
+
+/*
+ * Immutable picture of the machine taken at init: how many nodes there are, which node
+ * every possible CPU sits on (-1 for offline CPUs) and the node distance matrix as the
+ * firmware reports it, distance[from * nodes_num + to]. A refresh publishes a new
+ * snapshot instead of changing this one, so readers never take a lock.
+ */
+typedef struct numa_topology {
+    size_t nodes_num;
+    size_t cpus_num;
+    int *cpu_on_node;
+    int *distance;
+    int *physical_node; // physical_node[node]: the real node backing the memory of `node`
+    int emulated;
+    unsigned remote_delay_ns;
+    size_t map_size;
+    struct numa_topology *retired;
+} numa_topology;
+
+/*
+ * Presents `nodes` virtual nodes over the real CPUs and memory, so the multi-node paths
+ * can be run on a single socket. Virtual node v keeps its memory on real node
+ * v % real nodes and gets the CPUs of that real node round-robin. distance is a
+ * nodes * nodes matrix, NULL gives 10 locally and 10 more per hop around a ring from 20
+ * on. remote_delay_ns is spun on every allocator operation that touches the heap of
+ * another node, scaled by how much further than 10 it is, (distance - 10) / 10 of it.
+ */
+typedef struct {
+    size_t nodes;
+    const int *distance;
+    unsigned remote_delay_ns;
+} numa_emulation;
+
+extern numa_topology *current_topology;
+extern __thread int emulated_thread_node;
+
+int init_numa_topology(const numa_emulation *emulation);
+int refresh_numa_topology(void);
+void free_numa_topology(void);
 
 size_t get_numa_nodes_num(void);
-void parse_cpus_to_node(void);
+int numa_distance(int from, int to);
 
-#endif
+static inline int numa_node_of_cpu(int cpu) {
+    const numa_topology *topology = __atomic_load_n(&current_topology, __ATOMIC_ACQUIRE);
+    if (emulated_thread_node >= 0) return emulated_thread_node;
+    if (topology == NULL || cpu < 0 || (size_t) cpu >= topology->cpus_num) return -1;
 
+    return topology->cpu_on_node[cpu];
+}
+
+int emulate_thread_node(int node);
+void emulate_remote_access(int from, int to);
+
+int bind_memory(void *addr, size_t size, int node);
+int interleave_memory(void *addr, size_t size, size_t nodes);
+int page_node(const void *addr);
+int query_page_nodes(void **pages, size_t count, int *status);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "pagemap.h"
+
+#define ROOT_ENTRIES ((size_t) 1 << PAGEMAP_ROOT_BITS)
+#define LEAF_ENTRIES ((size_t) 1 << PAGEMAP_LEAF_BITS)
+
+static span ***root;
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *map_zeroed(size_t size) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+int pagemap_init(void) {
+    if (root != NULL) return 0;
+
+    // The root is only as resident as the address ranges that are actually used
+    root = (span ***) map_zeroed(ROOT_ENTRIES * sizeof(span **));
+    if (root == NULL) {
+        fprintf(stderr, "Failed to map the page map root\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void pagemap_free(void) {
+    if (root == NULL) return;
+
+    for (size_t i = 0U; i < ROOT_ENTRIES; i++) {
+        if (root[i] != NULL) munmap(root[i], LEAF_ENTRIES * sizeof(span *));
+    }
+
+    munmap(root, ROOT_ENTRIES * sizeof(span **));
+    root = NULL;
+}
+
+/*
+ * Points every page of [start, start + size) at `owner`, or clears them when owner is
+ * NULL. Registration happens on slow paths only, lookups never take a lock.
+ */
+int pagemap_set(void *start, size_t size, span *owner) {
+    uintptr_t first = (uintptr_t) start >> PAGEMAP_PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t) start + size - 1) >> PAGEMAP_PAGE_SHIFT;
+
+    for (uintptr_t page = first; page <= last; page++) {
+        size_t i = page >> PAGEMAP_LEAF_BITS;
+        span **leaf = __atomic_load_n(&root[i], __ATOMIC_ACQUIRE);
+
+        if (leaf == NULL) {
+            if (owner == NULL) continue;
+
+            pthread_mutex_lock(&grow_lock);
+            leaf = root[i];
+            if (leaf == NULL) {
+                leaf = (span **) map_zeroed(LEAF_ENTRIES * sizeof(span *));
+                if (leaf == NULL) {
+                    pthread_mutex_unlock(&grow_lock);
+                    fprintf(stderr, "Failed to map a page map leaf\n");
+                    return -1;
+                }
+                __atomic_store_n(&root[i], leaf, __ATOMIC_RELEASE);
+            }
+            pthread_mutex_unlock(&grow_lock);
+        }
+
+        __atomic_store_n(&leaf[page & (LEAF_ENTRIES - 1)], owner, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+span *pagemap_lookup(const void *ptr) {
+    uintptr_t page = (uintptr_t) ptr >> PAGEMAP_PAGE_SHIFT;
+    size_t i = page >> PAGEMAP_LEAF_BITS;
+
+    if (root == NULL || i >= ROOT_ENTRIES) return NULL;
+
+    span **leaf = __atomic_load_n(&root[i], __ATOMIC_ACQUIRE);
+    if (leaf == NULL) return NULL;
+
+    return __atomic_load_n(&leaf[page & (LEAF_ENTRIES - 1)], __ATOMIC_ACQUIRE);
+}
+
+void pagemap_lock(void) {
+    pthread_mutex_lock(&grow_lock);
+}
+
+void pagemap_unlock(void) {
+    pthread_mutex_unlock(&grow_lock);
+}
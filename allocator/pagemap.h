@@ -0,0 +1,25 @@
+#ifndef PAGEMAP
+#define PAGEMAP
+
+#include "allocator.h"
+
+/*
+ * The page map resolves any address to the span that owns it in constant time. It is a
+ * two level radix tree over the 36 bit page number of a 48 bit virtual address, the
+ * leaves are mapped on demand when a span is registered in a range not seen before.
+ */
+#define PAGEMAP_PAGE_SHIFT 12
+#define PAGEMAP_LEAF_BITS 18
+#define PAGEMAP_ROOT_BITS 18
+
+int pagemap_init(void);
+void pagemap_free(void);
+
+int pagemap_set(void *start, size_t size, span *owner);
+span *pagemap_lookup(const void *ptr);
+
+// Holds off page map growth, around fork()
+void pagemap_lock(void);
+void pagemap_unlock(void);
+
+#endif
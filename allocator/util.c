@@ -1,4 +1,3 @@
-#include <math.h>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -6,12 +5,16 @@
 
 size_t get_bin_index(size_t size) {
     for (size_t index = 0U; index < BINS; index++){
-	if (size <= (16 * pow(2, index))) return index;
+	if (size <= bin_size(index)) return index;
     }
 
     return BINS;
 }
 
+size_t bin_size(size_t bin_index) {
+    return (size_t) 16 << bin_index;
+}
+
 void print_allocation_info(void *ptr, size_t size) {
     // Get the CPU the thread is running on
     int cpu = sched_getcpu();
@@ -21,7 +24,7 @@ void print_allocation_info(void *ptr, size_t size) {
     }
 
     // Determine the NUMA node for the current CPU
-    int numa_node = cpu_on_node[cpu];
+    int numa_node = numa_node_of_cpu(cpu);
 
     // Print debug information
     printf("Allocated memory at address: %p\n", ptr);
@@ -42,19 +45,100 @@ void print_heap(numa_heap **numa_heaps, int node) {
 
     numa_heap *heap = numa_heaps[node];
     printf("Heap for NUMA Node %d:\n", node);
+    if (current_topology->emulated) {
+        printf("  Emulated on physical node %d, %u ns remote delay\n",
+               current_topology->physical_node[node], current_topology->remote_delay_ns);
+    }
     printf("  Start Address: %p\n", heap->start_addr);
-    printf("  Total Size: %zu bytes\n", heap->heap_size);
+    printf("  Backing: %s\n", page_backing_name(heap->backing));
+    printf("  Policy: %s\n", allocation_policy_name(heap->policy));
+    printf("  Distances:");
+    for (size_t to = 0U; to < get_numa_nodes_num(); to++) printf(" %d", numa_distance(node, (int) to));
+    printf("\n");
+    printf("  Reserved Size: %zu bytes\n", heap->reserved_size);
+    printf("  Committed Size: %zu bytes\n", heap->heap_size);
+    printf("  Carved Size: %zu bytes\n", heap->used_size);
+    printf("  Purged Size: %zu bytes in %zu purges\n", heap->purged_bytes + heap->tail_purged, heap->purges);
     printf("  Free Lists:\n");
 
     for (size_t bin = 0; bin < BINS; bin++) {
         printf("  Bin %zu:\n", bin);
-        free_block *current = heap->free_list[bin];
 
-        while (current) {
-            printf("    Block Address: %p, Size: %zu bytes\n", current->starting_addr, current->size);
-            current = (free_block *) current->next;
-        } 
+        for (span *owner = heap->bins[bin].spans; owner != NULL; owner = owner->next) {
+            size_t untouched = (size_t) ((char *) owner->start + owner->size - owner->bump_ptr);
+            printf("    Span Address: %p, Size: %zu bytes, Blocks In Use: %zu, Never Allocated: %zu blocks\n",
+                   owner->start, owner->size, owner->used, untouched / bin_size(bin));
+
+            for (free_block *current = owner->free_list; current; current = current->next) {
+                printf("      Block Address: %p, Size: %zu bytes\n", (void *) current, bin_size(bin));
+            }
+        }
+    }
+
+    printf("  Free Spans:\n");
+    for (size_t list = 0; list < FREE_SPAN_LISTS; list++) {
+        for (span *run = heap->free_spans[list]; run != NULL; run = run->next) {
+            printf("    Span Address: %p, Size: %zu bytes\n", run->start, run->size);
+        }
+    }
+
+    printf("  Remote Frees: %zu blocks, drained %zu in %zu batches\n",
+           __atomic_load_n(&heap->remote_frees, __ATOMIC_RELAXED), __atomic_load_n(&heap->remote_drained_blocks, __ATOMIC_RELAXED),
+           __atomic_load_n(&heap->remote_drains, __ATOMIC_RELAXED));
+
+    for (size_t i = 0U; i < heap->spill_nodes; i++) {
+        unsigned to = heap->spill_order[i];
+        printf("  Spilled To Node %u (distance %d): %zu blocks\n", to, numa_distance(node, (int) to),
+               __atomic_load_n(&heap->spills[to], __ATOMIC_RELAXED));
+    }
+
+    printf("  Large Span Cache: %zu bytes\n", heap->large_cached_bytes);
+    for (span *run = heap->large_cache; run != NULL; run = run->next) {
+        printf("    Span Address: %p, Size: %zu bytes\n", run->start, run->size);
     }
 }
 
+static void print_bin_stats(FILE *out, const char *name, const allocator_bin_stats *bin) {
+    fprintf(out, "  %-8s allocs %zu frees %zu remote frees %zu in use %zu free %zu locks %zu contended %zu\n",
+            name, bin->allocations, bin->frees, bin->remote_frees, bin->bytes_in_use, bin->free_bytes,
+            bin->lock_acquisitions, bin->contended_acquisitions);
+}
+
+/*
+ * Prints get_allocator_stats() one line per node and per bin that saw any allocation,
+ * for the dumps at exit and on a signal.
+ */
+void print_allocator_stats(FILE *out) {
+    allocator_stats *stats = get_allocator_stats();
+    if (stats == NULL) {
+        fprintf(out, "Allocator stats unavailable\n");
+        return;
+    }
+
+    for (size_t node = 0U; node < stats->nodes_num; node++) {
+        const allocator_node_stats *heap = &stats->nodes[node];
+
+        fprintf(out, "node %zu: committed %zu free %zu purged %zu spills %zu heap locks %zu contended %zu\n",
+                node, heap->committed_bytes, heap->free_bytes, heap->purged_bytes, heap->spills,
+                heap->lock_acquisitions, heap->contended_acquisitions);
+        fprintf(out, "  policy %s span fragmentation %.3f page fragmentation %.3f\n",
+                allocation_policy_name(get_heap_policy((unsigned) node)), heap->span_fragmentation,
+                heap->page_fragmentation);
 
+        for (size_t bin = 0U; bin <= BINS; bin++) {
+            if (heap->bins[bin].allocations == 0 && heap->bins[bin].frees == 0) continue;
+
+            char name[32];
+            if (bin == LARGE_BIN) snprintf(name, sizeof(name), "large");
+            else snprintf(name, sizeof(name), "%zu B", bin_size(bin));
+            print_bin_stats(out, name, &heap->bins[bin]);
+        }
+
+        if (heap->object_caches.allocations > 0 || heap->object_caches.frees > 0) {
+            print_bin_stats(out, "caches", &heap->object_caches);
+        }
+    }
+
+    fflush(out);
+    free_allocator_stats(stats);
+}
@@ -1,11 +1,15 @@
 #ifndef UTIL
 #define UTIL
 
+#include <stdio.h>
+
 #include "allocator.h"
 #include "numa.h"
 
 size_t get_bin_index(size_t size);
+size_t bin_size(size_t bin_index);
 void print_allocation_info(void *ptr, size_t size);
 void print_heap(numa_heap **numa_heaps, int node);
+void print_allocator_stats(FILE *out);
 
 #endif
@@ -35,7 +35,7 @@ std::vector<Traceable *> getPointers(Traceable *object) {
   std::cout << "[GC PTRS] Scanning Object at " << object << " (Size: " << object->getHeader()->size << std::endl;
   #endif
 
-  while (p < end) {
+  while (p + sizeof(uintptr_t) <= end) {
     auto address = (Traceable *)*(uintptr_t *)p;
     if (traceInfo.count(address) != 0) {
       #ifdef DEBUG
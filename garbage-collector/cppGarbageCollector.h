@@ -14,6 +14,9 @@ extern "C" {
   void init_allocator(size_t size);
   void* allocate_localy(size_t size);
   void* allocate_interleaved(size_t size);
+  void* allocate_on_node(int node, size_t size);
+  void* allocate_near(const void* ptr, size_t size);
+  int node_of(const void* ptr);
   void deallocate(void* ptr);
   void free_allocator();
 }
@@ -23,6 +26,18 @@ typedef struct ObjectHeader {
   size_t size;
 } ObjectHeader;
 
+// Placement tags for Traceable objects: new (OnNode{1}) T, new (Near{parent}) T, new (interleaved) T
+struct OnNode {
+  int node;
+};
+
+struct Near {
+  const void *object;
+};
+
+struct Interleaved {};
+constexpr Interleaved interleaved{};
+
 struct Traceable;
 extern std::unordered_map<Traceable *, ObjectHeader *> traceInfo;
 extern size_t gc_threshold_bytes;
@@ -99,17 +114,61 @@ struct Traceable {
 
     return object;
 }
- //  static void *operator numa_new(size_t size) {
- //    void *object = allocate_interleaved(size);
- //    if (!object) 
- //      std::cerr << "NUMA Allocation failed!\n";
- //    }
- // 
- //    auto header = new ObjectHeader{.marked = false, .size = size};
- //    traceInfo.insert(std::make_pair((Traceable *)object, header));
- //
- //    return object;
- //  }
+  static void *operator new(size_t size, OnNode where) {
+    return allocatePlaced(size, [&] { return allocate_on_node(where.node, size); });
+  }
+
+  static void *operator new(size_t size, Near where) {
+    return allocatePlaced(size, [&] { return allocate_near(where.object, size); });
+  }
+
+  static void *operator new(size_t size, Interleaved) {
+    return allocatePlaced(size, [&] { return allocate_interleaved(size); });
+  }
+
+  static void *operator new[](size_t size, OnNode where) {
+    return allocatePlaced(size, [&] { return allocate_on_node(where.node, size); });
+  }
+
+  static void *operator new[](size_t size, Near where) {
+    return allocatePlaced(size, [&] { return allocate_near(where.object, size); });
+  }
+
+  static void *operator new[](size_t size, Interleaved) {
+    return allocatePlaced(size, [&] { return allocate_interleaved(size); });
+  }
+
+  int node() const { return node_of(this); }
+
+private:
+  // Same path as operator new, with the placement decided by `allocate`
+  template <typename Allocate>
+  static void *allocatePlaced(size_t size, Allocate allocate) {
+    void *object = allocate();
+    if (!object) {
+      std::cerr << "[GC HANDLER] Placed allocation failed. Trying GC...\n";
+      gc();
+      object = allocate();
+
+      if (!object) {
+        std::cerr << "NUMA placed allocation failed after GC. Aborting.\n";
+        std::abort();
+      }
+    }
+
+    auto header = new ObjectHeader{.marked = false, .size = size};
+    traceInfo.insert(std::make_pair((Traceable *)object, header));
+
+    current_allocated_bytes += size;
+    if (current_allocated_bytes > gc_threshold_bytes) {
+#ifdef DEBUG
+      std::cout << "[GC HANDLER] invoking gc() after placed allocation" << std::endl;
+#endif
+      current_allocated_bytes = 0;
+    }
+
+    return object;
+  }
 };
 
 #endif
@@ -0,0 +1,114 @@
+#ifndef NUMA_ALLOCATOR_ADAPTERS_H
+#define NUMA_ALLOCATOR_ADAPTERS_H
+
+#include <new>
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+
+extern "C" {
+  void* allocate_localy(size_t size);
+  void* allocate_interleaved(size_t size);
+  void* allocate_on_node(int node, size_t size);
+  void deallocate(void* ptr);
+}
+
+// Standard containers on the node heaps:
+//   std::vector<int, numa::allocator<int, numa::on_node<1>>> onNode1;
+//   numa::memory_resource interleaved(numa::placement::interleaved);
+//   std::pmr::unordered_map<int, int> spread(&interleaved);
+namespace numa {
+
+// Placement policies of numa::allocator
+struct local {
+  static void* allocate(size_t size) { return allocate_localy(size); }
+};
+
+struct interleaved {
+  static void* allocate(size_t size) { return allocate_interleaved(size); }
+};
+
+template<int Node>
+struct on_node {
+  static void* allocate(size_t size) { return allocate_on_node(Node, size); }
+};
+
+namespace detail {
+
+// Blocks are aligned to their bin size up to a page, larger objects to a page
+constexpr size_t max_alignment = 4096;
+
+template<typename Allocate>
+void* allocate(size_t size, size_t alignment, Allocate allocate) {
+  if (alignment > max_alignment) throw std::bad_alloc();
+  if (size < alignment) size = alignment;
+
+  void* ptr = allocate(size ? size : 1);
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+
+}
+
+// Stateless allocator, every object comes from wherever Policy puts it and any numa::allocator
+// frees memory of any other, so they all compare equal
+template<typename T, typename Policy = local>
+class allocator {
+public:
+  using value_type = T;
+
+  template<typename U>
+  struct rebind {
+    using other = allocator<U, Policy>;
+  };
+
+  allocator() noexcept = default;
+
+  template<typename U>
+  allocator(const allocator<U, Policy>&) noexcept {}
+
+  T* allocate(size_t n) {
+    if (n > std::numeric_limits<size_t>::max() / sizeof(T)) throw std::bad_array_new_length();
+    return static_cast<T*>(detail::allocate(n * sizeof(T), alignof(T), Policy::allocate));
+  }
+
+  void deallocate(T* ptr, size_t) noexcept { ::deallocate(ptr); }
+};
+
+template<typename T, typename U, typename Policy, typename OtherPolicy>
+bool operator==(const allocator<T, Policy>&, const allocator<U, OtherPolicy>&) noexcept { return true; }
+
+template<typename T, typename U, typename Policy, typename OtherPolicy>
+bool operator!=(const allocator<T, Policy>&, const allocator<U, OtherPolicy>&) noexcept { return false; }
+
+enum class placement { local, interleaved, on_node };
+
+// std::pmr::memory_resource on the node heaps, placement picked at run time
+class memory_resource : public std::pmr::memory_resource {
+public:
+  explicit memory_resource(placement where = placement::local) noexcept : where(where), node(-1) {}
+  explicit memory_resource(int node) noexcept : where(placement::on_node), node(node) {}
+
+private:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    switch (where) {
+      case placement::interleaved: return detail::allocate(bytes, alignment, interleaved::allocate);
+      case placement::on_node:
+        return detail::allocate(bytes, alignment, [this](size_t size) { return allocate_on_node(node, size); });
+      default: return detail::allocate(bytes, alignment, local::allocate);
+    }
+  }
+
+  void do_deallocate(void* ptr, size_t, size_t) override { ::deallocate(ptr); }
+
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+    return dynamic_cast<const memory_resource*>(&other) != nullptr;
+  }
+
+  placement where;
+  int node;
+};
+
+}
+
+#endif
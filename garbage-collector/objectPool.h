@@ -0,0 +1,84 @@
+#ifndef NUMA_ALLOCATOR_OBJECT_POOL_H
+#define NUMA_ALLOCATOR_OBJECT_POOL_H
+
+#include <new>
+#include <cstddef>
+#include <utility>
+
+extern "C" {
+  struct object_cache;
+  typedef void (*object_hook)(void* object, void* arg);
+
+  object_cache* object_cache_create(size_t size, size_t align);
+  object_cache* object_cache_create_ctor(size_t size, size_t align, object_hook ctor, object_hook dtor, void* arg);
+  void* object_cache_alloc(object_cache* cache);
+  void object_cache_free(object_cache* cache, void* object);
+  void object_cache_destroy(object_cache* cache);
+}
+
+// Node-local pool of T sized slots: create() constructs, destroy() destructs and frees
+template<typename T>
+class ObjectPool {
+public:
+  ObjectPool() : cache(object_cache_create(sizeof(T), alignof(T))) {
+    if (!cache) throw std::bad_alloc();
+  }
+
+  ~ObjectPool() { object_cache_destroy(cache); }
+
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  template<typename... Args>
+  T* create(Args&&... args) {
+    void* slot = object_cache_alloc(cache);
+    if (!slot) throw std::bad_alloc();
+
+    try {
+      // ::new, Traceable types bring their own operator new
+      return ::new (slot) T(std::forward<Args>(args)...);
+    } catch (...) {
+      object_cache_free(cache, slot);
+      throw;
+    }
+  }
+
+  void destroy(T* object) {
+    object->~T();
+    object_cache_free(cache, object);
+  }
+
+private:
+  object_cache* cache;
+};
+
+// Pool of T that stay constructed while free: acquire() hands an object back in the state
+// release() left it in, T is only default constructed when its slab is carved
+template<typename T>
+class CachedObjectPool {
+public:
+  CachedObjectPool() : cache(object_cache_create_ctor(sizeof(T), alignof(T), construct, destruct, nullptr)) {
+    if (!cache) throw std::bad_alloc();
+  }
+
+  ~CachedObjectPool() { object_cache_destroy(cache); }
+
+  CachedObjectPool(const CachedObjectPool&) = delete;
+  CachedObjectPool& operator=(const CachedObjectPool&) = delete;
+
+  T* acquire() {
+    void* object = object_cache_alloc(cache);
+    if (!object) throw std::bad_alloc();
+    return static_cast<T*>(object);
+  }
+
+  void release(T* object) { object_cache_free(cache, object); }
+
+private:
+  static void construct(void* object, void*) { ::new (object) T(); }
+  static void destruct(void* object, void*) { static_cast<T*>(object)->~T(); }
+
+  object_cache* cache;
+};
+
+#endif
@@ -0,0 +1,376 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../allocator/allocator.h"
+#include "../allocator/numa.h"
+
+/*
+ * Multi-threaded allocator benchmark. Every allocator, workload, size distribution and
+ * thread count runs in its own forked process, so peak RSS and heap state belong to one
+ * run only, and prints one CSV line:
+ *
+ *   allocator,policy,workload,sizes,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,peak_rss_kb,span_fragmentation
+ *
+ * ops counts allocations and frees, latencies come from every SAMPLE_EVERY-th operation.
+ * The local allocator runs under every allocation policy; span_fragmentation is the
+ * share of the bins' spans left free but stranded, taken at the end of churn while all
+ * objects are still live.
+ * Threads are pinned round-robin over the nodes, thread t on node t % nodes.
+ *
+ * Usage: bench_allocator [ops per thread] [max threads]
+ */
+
+#define DEFAULT_OPS 200000
+#define SAMPLE_EVERY 8
+#define CHURN_SLOTS 1024
+#define CHURN_ROUNDS 8
+#define RING_SLOTS 4096
+#define HEAP_SIZE (64UL * 1024 * 1024)
+
+typedef struct {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void (*free)(void *ptr);
+    int numa;
+    allocation_policy policy;
+} allocator_ops;
+
+static void glibc_free(void *ptr) { free(ptr); }
+static void *glibc_malloc(size_t size) { return malloc(size); }
+
+static const allocator_ops allocators[] = {
+    { "numa_local", allocate_localy, deallocate, 1, segregated_free_lists },
+    { "numa_local", allocate_localy, deallocate, 1, best_fit_within_a_bin },
+    { "numa_local", allocate_localy, deallocate, 1, address_ordered_first_fit },
+    { "numa_interleaved", allocate_interleaved, deallocate, 1, segregated_free_lists },
+    { "glibc", glibc_malloc, glibc_free, 0, segregated_free_lists },
+};
+
+/*
+ * Size distributions: a fixed small size, and a service-like mix that is mostly small
+ * with a long tail, roughly what request handling and container code allocate.
+ */
+typedef enum { sizes_fixed64, sizes_mixed } size_dist;
+static const char *size_dist_names[] = { "fixed64", "mixed" };
+
+static size_t next_size(size_dist dist, unsigned *seed) {
+    if (dist == sizes_fixed64) return 64;
+
+    unsigned r = (unsigned) rand_r(seed);
+    unsigned bucket = r % 1000;
+    if (bucket < 500) return 8 + r % 57;        // 50% up to 64 bytes
+    if (bucket < 800) return 65 + r % 448;      // 30% up to 512 bytes
+    if (bucket < 950) return 513 + r % 3584;    // 15% up to 4 KiB
+    if (bucket < 999) return 4097 + r % 28672;  // 4.9% up to 32 KiB
+    return 32769 + r % (224 * 1024);            // 0.1% up to 256 KiB
+}
+
+typedef enum { workload_pairs, workload_churn, workload_prodcons } workload;
+static const char *workload_names[] = { "pairs", "churn", "prodcons" };
+
+// Single producer, single consumer ring the prodcons workload hands objects over with
+typedef struct {
+    void *slots[RING_SLOTS];
+    size_t head __attribute__((aligned(64)));
+    size_t tail __attribute__((aligned(64)));
+} ring;
+
+typedef struct {
+    const allocator_ops *allocator;
+    workload work;
+    size_dist dist;
+    size_t ops;
+    size_t index;
+    size_t threads;
+    pthread_barrier_t *start;
+    pthread_barrier_t *round; // between churn rounds
+    void ***churn_slots;      // every thread's slot array, handed on between rounds
+    ring *rings;
+    size_t done;              // allocations and frees made
+    uint64_t began, ended;
+    uint32_t *samples;
+    size_t sample_count;
+    double fragmentation;     // churn only, -1 when not taken
+} bench_thread;
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void pin_thread(size_t index) {
+    const numa_topology *topology = current_topology;
+    size_t node = index % topology->nodes_num;
+    size_t nth = index / topology->nodes_num;
+    size_t on_node = 0U;
+
+    for (size_t cpu = 0U; cpu < topology->cpus_num; cpu++) {
+        if (topology->cpu_on_node[cpu] == (int) node) on_node++;
+    }
+    if (on_node == 0) {
+        // An emulated node without CPUs of its own
+        emulate_thread_node((int) node);
+        return;
+    }
+
+    nth %= on_node;
+    for (size_t cpu = 0U; cpu < topology->cpus_num && cpu < CPU_SETSIZE; cpu++) {
+        if (topology->cpu_on_node[cpu] != (int) node || nth-- > 0) continue;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+        return;
+    }
+}
+
+static void *timed_alloc(bench_thread *self, size_t size) {
+    if (self->done++ % SAMPLE_EVERY != 0) return self->allocator->alloc(size);
+
+    uint64_t start = now_ns();
+    void *ptr = self->allocator->alloc(size);
+    self->samples[self->sample_count++] = (uint32_t) (now_ns() - start);
+    return ptr;
+}
+
+static void timed_free(bench_thread *self, void *ptr) {
+    if (self->done++ % SAMPLE_EVERY != 0) {
+        self->allocator->free(ptr);
+        return;
+    }
+
+    uint64_t start = now_ns();
+    self->allocator->free(ptr);
+    self->samples[self->sample_count++] = (uint32_t) (now_ns() - start);
+}
+
+static void *checked(void *ptr) {
+    if (ptr == NULL) {
+        fprintf(stderr, "Allocation failed\n");
+        exit(1);
+    }
+
+    *(volatile char *) ptr = 1;
+    return ptr;
+}
+
+// Allocation immediately followed by its free
+static void run_pairs(bench_thread *self, unsigned *seed) {
+    for (size_t op = 0U; op < self->ops; op += 2) {
+        void *ptr = checked(timed_alloc(self, next_size(self->dist, seed)));
+        timed_free(self, ptr);
+    }
+}
+
+/*
+ * Larson-style churn: each thread replaces random objects of a slot array, and after
+ * every round the arrays move on to the next thread, which frees what another thread
+ * allocated.
+ */
+static void run_churn(bench_thread *self, unsigned *seed) {
+    void **slots = self->churn_slots[self->index];
+
+    for (size_t slot = 0U; slot < CHURN_SLOTS; slot++) {
+        slots[slot] = checked(timed_alloc(self, next_size(self->dist, seed)));
+    }
+
+    size_t per_round = self->ops / CHURN_ROUNDS / 2;
+    for (size_t round = 0U; round < CHURN_ROUNDS; round++) {
+        for (size_t i = 0U; i < per_round; i++) {
+            size_t slot = (size_t) rand_r(seed) % CHURN_SLOTS;
+            timed_free(self, slots[slot]);
+            slots[slot] = checked(timed_alloc(self, next_size(self->dist, seed)));
+        }
+
+        pthread_barrier_wait(self->round);
+        slots = self->churn_slots[(self->index + round + 1) % self->threads];
+    }
+
+    if (self->index == 0 && self->allocator->numa) {
+        allocator_stats *stats = get_allocator_stats();
+        if (stats != NULL) self->fragmentation = stats->total.span_fragmentation;
+        free_allocator_stats(stats);
+    }
+    pthread_barrier_wait(self->round);
+
+    for (size_t slot = 0U; slot < CHURN_SLOTS; slot++) timed_free(self, slots[slot]);
+}
+
+/*
+ * Even threads allocate and hand the objects to the odd thread next to them, which runs
+ * on the next node over and frees them there.
+ */
+static void run_prodcons(bench_thread *self, unsigned *seed) {
+    ring *channel = &self->rings[self->index / 2];
+    size_t objects = self->ops / 2;
+
+    for (size_t op = 0U; op < objects; op++) {
+        if (self->index % 2 == 0) {
+            void *ptr = checked(timed_alloc(self, next_size(self->dist, seed)));
+            size_t head = channel->head;
+            while (head - __atomic_load_n(&channel->tail, __ATOMIC_ACQUIRE) == RING_SLOTS) sched_yield();
+            channel->slots[head % RING_SLOTS] = ptr;
+            __atomic_store_n(&channel->head, head + 1, __ATOMIC_RELEASE);
+        } else {
+            size_t tail = channel->tail;
+            while (__atomic_load_n(&channel->head, __ATOMIC_ACQUIRE) == tail) sched_yield();
+            void *ptr = channel->slots[tail % RING_SLOTS];
+            __atomic_store_n(&channel->tail, tail + 1, __ATOMIC_RELEASE);
+            timed_free(self, ptr);
+        }
+    }
+}
+
+static void *bench_worker(void *arg) {
+    bench_thread *self = (bench_thread *) arg;
+    unsigned seed = 42 + (unsigned) self->index;
+
+    pin_thread(self->index);
+    pthread_barrier_wait(self->start);
+    self->began = now_ns();
+
+    switch (self->work) {
+        case workload_pairs: run_pairs(self, &seed); break;
+        case workload_churn: run_churn(self, &seed); break;
+        case workload_prodcons: run_prodcons(self, &seed); break;
+    }
+
+    self->ended = now_ns();
+
+    return NULL;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static long peak_rss_kb(void) {
+    FILE *status = fopen("/proc/self/status", "r");
+    char line[256];
+    long peak = -1;
+
+    if (!status) return -1;
+    while (fgets(line, sizeof(line), status)) {
+        if (sscanf(line, "VmHWM: %ld kB", &peak) == 1) break;
+    }
+    fclose(status);
+
+    return peak;
+}
+
+static void run(const allocator_ops *allocator, workload work, size_dist dist, size_t threads, size_t ops) {
+    pthread_t ids[threads];
+    bench_thread args[threads];
+    void **churn_slots[threads];
+    pthread_barrier_t start, round;
+
+    // Workers start together once all of them are pinned
+    pthread_barrier_init(&start, NULL, (unsigned) threads);
+    pthread_barrier_init(&round, NULL, (unsigned) threads);
+
+    ring *rings = calloc(threads / 2 + 1, sizeof(ring));
+    size_t max_samples = (ops + 2 * CHURN_SLOTS) / SAMPLE_EVERY + 2;
+
+    for (size_t t = 0U; t < threads; t++) {
+        churn_slots[t] = calloc(CHURN_SLOTS, sizeof(void *));
+        args[t] = (bench_thread) {
+            .allocator = allocator, .work = work, .dist = dist, .ops = ops, .index = t,
+            .threads = threads, .start = &start, .round = &round, .churn_slots = churn_slots,
+            .rings = rings, .samples = malloc(max_samples * sizeof(uint32_t)), .fragmentation = -1.0,
+        };
+    }
+
+    for (size_t t = 0U; t < threads; t++) pthread_create(&ids[t], NULL, bench_worker, &args[t]);
+
+    for (size_t t = 0U; t < threads; t++) pthread_join(ids[t], NULL);
+
+    // From the first worker starting to the last one finishing
+    size_t total_samples = 0U, total_ops = 0U;
+    uint64_t began = args[0].began, ended = args[0].ended;
+    for (size_t t = 0U; t < threads; t++) {
+        total_samples += args[t].sample_count;
+        total_ops += args[t].done;
+        if (args[t].began < began) began = args[t].began;
+        if (args[t].ended > ended) ended = args[t].ended;
+    }
+    double seconds = (double) (ended - began) / 1e9;
+
+    uint32_t *samples = malloc((total_samples + 1) * sizeof(uint32_t));
+    for (size_t t = 0U, at = 0U; t < threads; t++) {
+        memcpy(samples + at, args[t].samples, args[t].sample_count * sizeof(uint32_t));
+        at += args[t].sample_count;
+        free(args[t].samples);
+        free(churn_slots[t]);
+    }
+
+    qsort(samples, total_samples, sizeof(uint32_t), compare_samples);
+    uint32_t p50 = total_samples ? samples[total_samples * 50 / 100] : 0;
+    uint32_t p99 = total_samples ? samples[total_samples * 99 / 100] : 0;
+    uint32_t p999 = total_samples ? samples[total_samples * 999 / 1000] : 0;
+
+    char fragmentation[32] = "";
+    if (args[0].fragmentation >= 0) snprintf(fragmentation, sizeof(fragmentation), "%.3f", args[0].fragmentation);
+
+    printf("%s,%s,%s,%s,%zu,%zu,%.4f,%.0f,%u,%u,%u,%ld,%s\n", allocator->name,
+           allocator->numa ? allocation_policy_name(allocator->policy) : "", workload_names[work],
+           size_dist_names[dist], threads, total_ops, seconds, total_ops / seconds, p50, p99, p999,
+           peak_rss_kb(), fragmentation);
+    fflush(stdout);
+
+    free(samples);
+    free(rings);
+    pthread_barrier_destroy(&start);
+    pthread_barrier_destroy(&round);
+}
+
+int main(int argc, char **argv) {
+    size_t ops = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_OPS;
+    size_t max_threads = argc > 2 ? strtoull(argv[2], NULL, 10) : (size_t) sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads == 0) max_threads = 1;
+
+    printf("allocator,policy,workload,sizes,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,peak_rss_kb,"
+           "span_fragmentation\n");
+    fflush(stdout);
+
+    for (size_t a = 0U; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+        for (workload work = workload_pairs; work <= workload_prodcons; work++) {
+            for (size_dist dist = sizes_fixed64; dist <= sizes_mixed; dist++) {
+                // 1, 2, 4, ... and all cores, producers and consumers come in pairs
+                for (size_t threads = 1U;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+                    size_t count = work == workload_prodcons && threads % 2 ? threads + 1 : threads;
+                    if (work == workload_prodcons && threads == 1 && max_threads > 1) continue;
+
+                    pid_t child = fork();
+                    if (child == 0) {
+                        allocator_config config = { .heap_size = HEAP_SIZE, .policy = allocators[a].policy };
+                        init_allocator_with_config(&config);
+                        run(&allocators[a], work, dist, count, ops);
+                        free_allocator();
+                        _exit(0);
+                    }
+
+                    int status;
+                    waitpid(child, &status, 0);
+                    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                        fprintf(stderr, "%s %s %s %zu threads failed\n", allocators[a].name,
+                                workload_names[work], size_dist_names[dist], count);
+                    }
+
+                    if (threads == max_threads) break;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,327 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../allocator/allocator.h"
+#include "../allocator/numa.h"
+
+/*
+ * Checks that memory ends up where the allocator says it does and what that is worth.
+ *
+ * The placement table asks the kernel with move_pages where every page of the objects
+ * a policy handed out sits, and reports the share placed on the expected node: the
+ * allocating thread's node for local, the requested node for on_node, the parent's node
+ * for near. Interleaved objects have no single right node, there placed_pct is how
+ * evenly their pages are spread, 100 when every node holds the same share. Under an
+ * emulated topology pages are counted on the physical nodes behind the virtual ones.
+ *
+ * The kernel table runs a streaming triad and a pointer chase from a thread on node 0
+ * over memory that is local, on the next node (remote), or interleaved over all nodes.
+ *
+ * Usage: bench_locality [kernel buffer MiB]
+ */
+
+#define OBJECTS 4096
+#define DEFAULT_BUFFER_MIB 64
+#define STREAM_RUNS 5
+#define CHASE_HOPS (4UL * 1024 * 1024)
+#define LINE 64
+
+static size_t page_size;
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// Pins the calling thread to the first CPU of `node`, emulated nodes may have none
+static int pin_to_node(int node) {
+    const numa_topology *topology = current_topology;
+
+    for (size_t cpu = 0U; cpu < topology->cpus_num && cpu < CPU_SETSIZE; cpu++) {
+        if (topology->cpu_on_node[cpu] != node) continue;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    return emulate_thread_node(node);
+}
+
+// Real nodes behind the topology, the kernel reports pages on those
+static size_t physical_nodes(size_t nodes) {
+    size_t physical = 0U;
+
+    for (size_t node = 0U; node < nodes; node++) {
+        if ((size_t) current_topology->physical_node[node] + 1 > physical) physical = current_topology->physical_node[node] + 1;
+    }
+
+    return physical;
+}
+
+static size_t object_size(size_t i) {
+    static const size_t sizes[] = { 16, 48, 200, 1000, 4096, 20000, 100000, 1 << 20 };
+    size_t count = sizeof(sizes) / sizeof(sizes[0]);
+
+    // Large objects are rare, as they are in practice
+    return i % 64 == 63 ? sizes[count - 1 - i / 64 % 2] : sizes[i % (count - 2)];
+}
+
+typedef struct {
+    size_t pages;
+    size_t placed;
+    size_t per_node[MAX_NODES];
+} placement;
+
+// Counts where every page of [ptr, ptr + size) sits against the expected node
+static void check_object(placement *result, void *ptr, size_t size, int expected) {
+    char *first = (char *) ((uintptr_t) ptr & ~(uintptr_t) (page_size - 1));
+    size_t count = ((char *) ptr + size - first + page_size - 1) / page_size;
+    void *pages[count];
+    int status[count];
+
+    if (expected >= 0) expected = current_topology->physical_node[expected];
+
+    for (size_t i = 0U; i < count; i++) pages[i] = first + i * page_size;
+    if (query_page_nodes(pages, count, status) != 0) return;
+
+    for (size_t i = 0U; i < count; i++) {
+        result->pages++;
+        if (status[i] < 0) continue;
+
+        result->per_node[status[i]]++;
+        if (status[i] == expected) result->placed++;
+    }
+}
+
+typedef enum { policy_local, policy_on_node, policy_near, policy_interleaved } policy;
+static const char *policy_names[] = { "local", "on_node", "near", "interleaved" };
+
+typedef struct {
+    policy kind;
+    int thread_node;
+    int target_node;
+    placement result;
+} placement_job;
+
+static void *placement_worker(void *arg) {
+    placement_job *job = (placement_job *) arg;
+    void **objects = calloc(OBJECTS, sizeof(void *));
+    void *parent = NULL;
+
+    if (pin_to_node(job->thread_node) != 0) {
+        fprintf(stderr, "No CPU to run on node %d\n", job->thread_node);
+        free(objects);
+        return NULL;
+    }
+
+    if (job->kind == policy_near) parent = allocate_on_node(job->target_node, 64);
+
+    for (size_t i = 0U; i < OBJECTS; i++) {
+        size_t size = object_size(i);
+
+        switch (job->kind) {
+            case policy_local: objects[i] = allocate_localy(size); break;
+            case policy_on_node: objects[i] = allocate_on_node(job->target_node, size); break;
+            case policy_near: objects[i] = allocate_near(parent, size); break;
+            case policy_interleaved: objects[i] = allocate_interleaved(size); break;
+        }
+
+        if (objects[i] == NULL) {
+            fprintf(stderr, "%s allocation %zu failed\n", policy_names[job->kind], i);
+            break;
+        }
+        memset(objects[i], 1, size);
+    }
+
+    int expected = job->kind == policy_local ? job->thread_node : job->target_node;
+    for (size_t i = 0U; i < OBJECTS && objects[i] != NULL; i++) {
+        check_object(&job->result, objects[i], object_size(i), expected);
+    }
+
+    for (size_t i = 0U; i < OBJECTS && objects[i] != NULL; i++) deallocate(objects[i]);
+    if (parent != NULL) deallocate(parent);
+    free(objects);
+
+    return NULL;
+}
+
+static void report_placement(placement_job *job, size_t nodes) {
+    placement *result = &job->result;
+    double placed_pct = result->pages ? 100.0 * result->placed / result->pages : 0.0;
+
+    size_t physical = physical_nodes(nodes);
+
+    if (job->kind == policy_interleaved) {
+        size_t fewest = result->per_node[0];
+        for (size_t node = 1U; node < physical; node++) {
+            if (result->per_node[node] < fewest) fewest = result->per_node[node];
+        }
+        placed_pct = result->pages ? 100.0 * fewest * physical / result->pages : 0.0;
+    }
+
+    printf("%s,%d,%d,%zu,%.2f,", policy_names[job->kind], job->thread_node, job->target_node,
+           result->pages, placed_pct);
+    for (size_t node = 0U; node < physical; node++) {
+        printf("%s%zu", node ? ":" : "", result->per_node[node]);
+    }
+    printf("\n");
+}
+
+static void run_placement(size_t nodes) {
+    printf("policy,thread_node,target_node,pages,placed_pct,pages_per_node\n");
+
+    placement_job *jobs = calloc(nodes * 2 + 2, sizeof(placement_job));
+    size_t count = 0U;
+
+    for (size_t node = 0U; node < nodes; node++) {
+        jobs[count++] = (placement_job) { .kind = policy_local, .thread_node = (int) node, .target_node = (int) node };
+    }
+    for (size_t node = 0U; node < nodes; node++) {
+        jobs[count++] = (placement_job) { .kind = policy_on_node, .thread_node = 0, .target_node = (int) node };
+    }
+    jobs[count++] = (placement_job) { .kind = policy_near, .thread_node = 0, .target_node = (int) nodes - 1 };
+    jobs[count++] = (placement_job) { .kind = policy_interleaved, .thread_node = 0, .target_node = -1 };
+
+    for (size_t i = 0U; i < count; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, placement_worker, &jobs[i]);
+        pthread_join(thread, NULL);
+        report_placement(&jobs[i], nodes);
+    }
+
+    free(jobs);
+    printf("\n");
+}
+
+typedef struct {
+    const char *name;
+    int node; // for local and remote
+    size_t bytes;
+} kernel_job;
+
+static void *alloc_for(const kernel_job *job, size_t bytes) {
+    if (strcmp(job->name, "interleaved") == 0) return allocate_interleaved(bytes);
+    if (strcmp(job->name, "remote") == 0) return allocate_on_node(job->node, bytes);
+
+    return allocate_localy(bytes);
+}
+
+// a[i] = b[i] + 3 * c[i], best of STREAM_RUNS runs, in GB/s
+static double stream_triad(const kernel_job *job) {
+    size_t n = job->bytes / 3 / sizeof(double);
+    double *a = alloc_for(job, n * sizeof(double));
+    double *b = alloc_for(job, n * sizeof(double));
+    double *c = alloc_for(job, n * sizeof(double));
+    double best = 0.0;
+
+    if (!a || !b || !c) return 0.0;
+
+    for (size_t i = 0U; i < n; i++) {
+        a[i] = 0.0;
+        b[i] = 1.0;
+        c[i] = 2.0;
+    }
+
+    for (int run = 0; run < STREAM_RUNS; run++) {
+        uint64_t start = now_ns();
+        for (size_t i = 0U; i < n; i++) a[i] = b[i] + 3.0 * c[i];
+        double seconds = (double) (now_ns() - start) / 1e9;
+
+        double rate = 3.0 * n * sizeof(double) / seconds / 1e9;
+        if (rate > best) best = rate;
+    }
+
+    // Keeps the compiler from dropping the loop
+    if (a[n / 2] != 7.0) fprintf(stderr, "stream check failed\n");
+
+    deallocate(a);
+    deallocate(b);
+    deallocate(c);
+    return best;
+}
+
+// Walks a random cycle through the buffer one cache line per hop, in ns per hop
+static double pointer_chase(const kernel_job *job) {
+    size_t lines = job->bytes / LINE;
+    char *buffer = alloc_for(job, lines * LINE);
+    size_t *order = malloc(lines * sizeof(size_t));
+
+    if (!buffer || !order) return 0.0;
+
+    for (size_t i = 0U; i < lines; i++) order[i] = i;
+    unsigned seed = 7;
+    for (size_t i = lines - 1; i > 0; i--) {
+        size_t j = (size_t) rand_r(&seed) % (i + 1);
+        size_t swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    for (size_t i = 0U; i < lines; i++) {
+        *(void **) (buffer + order[i] * LINE) = buffer + order[(i + 1) % lines] * LINE;
+    }
+    free(order);
+
+    void **cursor = (void **) buffer;
+    uint64_t start = now_ns();
+    for (size_t hop = 0U; hop < CHASE_HOPS; hop++) cursor = (void **) *cursor;
+    double ns = (double) (now_ns() - start) / CHASE_HOPS;
+
+    if (cursor == NULL) fprintf(stderr, "chase check failed\n");
+
+    deallocate(buffer);
+    return ns;
+}
+
+static void *kernel_worker(void *arg) {
+    kernel_job *job = (kernel_job *) arg;
+
+    pin_to_node(0);
+
+    double triad = stream_triad(job);
+    double chase = pointer_chase(job);
+
+    printf("%s,%d,%zu,%.2f,%.2f\n", job->name, strcmp(job->name, "interleaved") ? job->node : -1,
+           job->bytes >> 20, triad, chase);
+    return NULL;
+}
+
+static void run_kernels(size_t nodes, size_t bytes) {
+    printf("memory,node,buffer_mib,triad_gb_s,chase_ns_per_hop\n");
+
+    kernel_job jobs[] = {
+        { "local", 0, bytes },
+        { "remote", (int) (1 % nodes), bytes },
+        { "interleaved", -1, bytes },
+    };
+
+    for (size_t i = 0U; i < sizeof(jobs) / sizeof(jobs[0]); i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, kernel_worker, &jobs[i]);
+        pthread_join(thread, NULL);
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t buffer_mib = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_BUFFER_MIB;
+
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
+    init_allocator(64UL * 1024 * 1024);
+
+    size_t nodes = get_numa_nodes_num();
+    if (nodes == 1) fprintf(stderr, "Single node machine, remote runs use node 0\n");
+
+    run_placement(nodes);
+    run_kernels(nodes, buffer_mib << 20);
+
+    free_allocator();
+    return 0;
+}
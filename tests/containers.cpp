@@ -0,0 +1,60 @@
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <string>
+#include "../garbage-collector/cppGarbageCollector.h"
+#include "../garbage-collector/numaAllocator.h"
+
+struct alignas(64) Counter {
+  uint64_t value;
+};
+
+int main() {
+  gcInit(1024 * 1024 * 100);
+
+  {
+    // A vector and a map pinned to node 0 without touching their code
+    std::vector<int, numa::allocator<int, numa::on_node<0>>> values;
+    for (int i = 0; i < 100000; ++i) values.push_back(i);
+
+    std::unordered_map<int, std::string, std::hash<int>, std::equal_to<int>,
+                       numa::allocator<std::pair<const int, std::string>, numa::local>> names;
+    for (int i = 0; i < 1000; ++i) names[i] = std::to_string(i);
+
+    if (node_of(values.data()) != 0 || names.at(999) != "999") {
+      std::cerr << "Containers on the node heaps went wrong\n";
+      return 1;
+    }
+
+    std::vector<Counter, numa::allocator<Counter, numa::interleaved>> counters(64);
+    for (Counter& counter : counters) {
+      if ((uintptr_t)&counter % alignof(Counter) != 0) {
+        std::cerr << "Counter is misaligned\n";
+        return 1;
+      }
+    }
+
+    std::cout << "values on node " << node_of(values.data()) << ", names on node " << node_of(&*names.begin()) << "\n";
+  }
+
+  {
+    numa::memory_resource onNode0(0);
+    numa::memory_resource spread(numa::placement::interleaved);
+
+    std::pmr::vector<double> samples(&onNode0);
+    samples.resize(1 << 20);
+    std::pmr::unordered_map<int, int> table(&spread);
+    for (int i = 0; i < 10000; ++i) table[i] = i * 2;
+
+    if (node_of(samples.data()) != 0 || table.at(9999) != 19998 || !onNode0.is_equal(spread)) {
+      std::cerr << "pmr containers on the node heaps went wrong\n";
+      return 1;
+    }
+
+    std::cout << "pmr samples on node " << node_of(samples.data()) << "\n";
+  }
+
+  gcFree();
+
+  return 0;
+}
@@ -0,0 +1,153 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../allocator/allocator.h"
+#include "../allocator/numa.h"
+
+/*
+ * Exercises the paths only a multi-node machine takes, on any machine when run as
+ * NUMA_EMULATE_NODES=4 ./emulation_test: one thread per node frees what the next node's
+ * thread allocated, singly and with the batch calls, a thread exhausts its capped node
+ * heap and has to spill, and the memory freed on the way is purged.
+ */
+
+#define MAX_HEAP_SIZE (4UL * 1024 * 1024)
+#define OBJECTS 2000
+#define SPILL_OBJECTS (MAX_HEAP_SIZE / SPILL_SIZE)
+#define SPILL_SIZE 4096
+
+static size_t nodes;
+static void **objects[MAX_NODES];
+static void **batches[MAX_NODES];
+static pthread_barrier_t barrier;
+static int failed;
+
+#define CHECK(condition, ...) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            __atomic_store_n(&failed, 1, __ATOMIC_RELAXED); \
+        } \
+    } while (0)
+
+static size_t object_size(size_t i) {
+    return 16 + i * 37 % 1000;
+}
+
+static void check_placement(void **ptrs, size_t count, int node, const char *what) {
+    for (size_t i = 0U; i < count; i++) {
+        CHECK(ptrs[i] != NULL, "%s %zu on node %d failed", what, i, node);
+        if (ptrs[i] != NULL) CHECK(node_of(ptrs[i]) == node, "%s %zu is on node %d, not %d", what, i, node_of(ptrs[i]), node);
+    }
+}
+
+static void *node_worker(void *arg) {
+    int node = (int) (size_t) arg;
+    size_t next = ((size_t) node + 1) % nodes;
+
+    CHECK(emulate_thread_node(node) == 0, "Cannot run on node %d", node);
+
+    for (size_t i = 0U; i < OBJECTS; i++) {
+        objects[node][i] = allocate_localy(object_size(i));
+        if (objects[node][i] != NULL) memset(objects[node][i], node, object_size(i));
+    }
+    check_placement(objects[node], OBJECTS, node, "object");
+
+    size_t got = allocate_batch(200, OBJECTS, batches[node]);
+    CHECK(got == OBJECTS, "Batch on node %d got %zu of %d", node, got, OBJECTS);
+    check_placement(batches[node], got, node, "batch object");
+
+    pthread_barrier_wait(&barrier);
+
+    // Everything allocated on the next node is freed from this one
+    for (size_t i = 0U; i < OBJECTS; i++) {
+        unsigned char *object = (unsigned char *) objects[next][i];
+        if (object == NULL) continue;
+
+        CHECK(object[0] == next, "object %zu of node %zu was overwritten", i, next);
+        deallocate(object);
+    }
+    deallocate_batch(batches[next], OBJECTS);
+
+    return NULL;
+}
+
+// Fills node 0 past its cap, the rest has to come from the other nodes
+static void *spill_worker(void *arg) {
+    void **spilled = (void **) arg;
+
+    CHECK(emulate_thread_node(0) == 0, "Cannot run on node 0");
+
+    for (size_t i = 0U; i < SPILL_OBJECTS; i++) {
+        spilled[i] = allocate_localy(SPILL_SIZE);
+        CHECK(spilled[i] != NULL, "Spilling allocation %zu failed", i);
+        if (spilled[i] != NULL) memset(spilled[i], 1, SPILL_SIZE);
+    }
+    for (size_t i = 0U; i < SPILL_OBJECTS; i++) {
+        if (spilled[i] != NULL) deallocate(spilled[i]);
+    }
+
+    return NULL;
+}
+
+int main(void) {
+    allocator_config config = { .heap_size = 1024 * 1024, .max_heap_size = MAX_HEAP_SIZE };
+
+    if (init_allocator_with_config(&config) != 0) {
+        fprintf(stderr, "Allocator init failed\n");
+        return 1;
+    }
+
+    nodes = get_numa_nodes_num();
+    if (nodes < 2) {
+        fprintf(stderr, "Needs several nodes, run as NUMA_EMULATE_NODES=4 ./emulation_test\n");
+        free_allocator();
+        return 1;
+    }
+
+    pthread_t threads[MAX_NODES];
+    pthread_barrier_init(&barrier, NULL, (unsigned) nodes);
+    for (size_t node = 0U; node < nodes; node++) {
+        objects[node] = calloc(OBJECTS, sizeof(void *));
+        batches[node] = calloc(OBJECTS, sizeof(void *));
+        pthread_create(&threads[node], NULL, node_worker, (void *) node);
+    }
+    for (size_t node = 0U; node < nodes; node++) pthread_join(threads[node], NULL);
+    pthread_barrier_destroy(&barrier);
+
+    allocator_stats *stats = get_allocator_stats();
+    size_t remote_frees = 0U;
+    for (size_t bin = 0U; bin < BINS; bin++) remote_frees += stats->total.bins[bin].remote_frees;
+    CHECK(remote_frees >= nodes * OBJECTS * 2, "Only %zu remote frees counted", remote_frees);
+    free_allocator_stats(stats);
+
+    void **spilled = calloc(SPILL_OBJECTS, sizeof(void *));
+    pthread_t spiller;
+    pthread_create(&spiller, NULL, spill_worker, spilled);
+    pthread_join(spiller, NULL);
+
+    size_t spills = 0U;
+    for (size_t node = 1U; node < nodes; node++) spills += get_spill_count(0, (unsigned) node);
+    CHECK(spills > 0, "Node 0 never spilled past its %lu byte cap", MAX_HEAP_SIZE);
+
+    // All threads are gone and flushed their caches, so the freed spans can go
+    purge_allocator();
+    size_t purged = 0U;
+    for (size_t node = 0U; node < nodes; node++) purged += get_heap_purged_bytes((unsigned) node);
+    CHECK(purged > 0, "Nothing was purged");
+
+    printf("%zu nodes: %zu remote frees, %zu spilled blocks, %zu bytes purged\n", nodes, remote_frees, spills, purged);
+
+    for (size_t node = 0U; node < nodes; node++) {
+        free(objects[node]);
+        free(batches[node]);
+    }
+    free(spilled);
+    free_allocator();
+
+    printf(failed ? "emulation test failed\n" : "emulation test passed\n");
+    return failed;
+}
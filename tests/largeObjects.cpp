@@ -0,0 +1,48 @@
+#include <iostream>
+#include <random>
+#include <ctime>
+#include "../garbage-collector/cppGarbageCollector.h"
+
+// Above the biggest bin, these go through the large object path
+struct Buffer64K : public Traceable {
+    uint8_t data[64 * 1024];
+};
+
+struct Buffer1M : public Traceable {
+    uint8_t data[1024 * 1024];
+};
+
+struct Buffer4M : public Traceable {
+    uint8_t data[4 * 1024 * 1024];
+};
+
+int main() {
+  gcInit(1024 * 1024 * 100);
+  std::mt19937 rng(time(nullptr));
+  std::uniform_int_distribution<int> dist(0, 2);
+
+  for (int round = 0; round < 4; ++round) {
+    for (int i = 0; i < 16; ++i) {
+      Traceable* obj = nullptr;
+
+      switch (dist(rng)) {
+        case 0: obj = new Buffer64K(); break;
+        case 1: obj = new Buffer1M(); break;
+        case 2: obj = new Buffer4M(); break;
+      }
+
+      obj = nullptr;
+    }
+
+    // Collected buffers are cached by the allocator and reused by the next round
+    gc();
+  }
+
+  Buffer4M* kept = new Buffer4M();
+  for (size_t i = 0; i < sizeof(kept->data); i += 4096) kept->data[i] = (uint8_t)i;
+  std::cout << "Allocated " << sizeof(Buffer4M) << " byte object at " << kept << "\n";
+
+  gcFree();
+
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include <iostream>
+#include "../garbage-collector/cppGarbageCollector.h"
+#include "../garbage-collector/objectPool.h"
+
+extern "C" size_t get_allocation_size(const void* ptr);
+
+struct Order {
+  uint64_t id;
+  uint32_t quantity;
+  uint32_t price;
+  char symbol[12];
+};
+
+static int constructed = 0;
+static int destructed = 0;
+
+struct Connection {
+  char buffer[200];
+  int uses = 0;
+
+  Connection() { constructed++; }
+  ~Connection() { destructed++; }
+};
+
+int main() {
+  gcInit(1024 * 1024 * 100);
+
+  {
+    ObjectPool<Order> orders;
+    Order* book[1000];
+
+    for (int i = 0; i < 1000; ++i) {
+      book[i] = orders.create(Order{(uint64_t)i, 10, 100, "NUMA"});
+      if (get_allocation_size(book[i]) != sizeof(Order)) {
+        std::cerr << "Order " << i << " is not exactly sized\n";
+        return 1;
+      }
+    }
+
+    // Slabs are cut to the object size, so the orders sit back to back
+    if ((char*)book[1] - (char*)book[0] != sizeof(Order)) {
+      std::cerr << "Orders are " << (char*)book[1] - (char*)book[0] << " bytes apart\n";
+      return 1;
+    }
+
+    for (int i = 0; i < 1000; ++i) {
+      if (book[i]->id != (uint64_t)i) {
+        std::cerr << "Order " << i << " was overwritten\n";
+        return 1;
+      }
+      orders.destroy(book[i]);
+    }
+
+    std::cout << "Orders on node " << node_of(book[0]) << "\n";
+  }
+
+  {
+    CachedObjectPool<Connection> connections;
+    Connection* open[100];
+
+    for (int round = 0; round < 10; ++round) {
+      for (int i = 0; i < 100; ++i) {
+        open[i] = connections.acquire();
+        open[i]->uses++;
+      }
+      for (int i = 0; i < 100; ++i) connections.release(open[i]);
+    }
+
+    // Objects stay constructed between uses, only the slab carving runs the constructor
+    if (constructed >= 1000) {
+      std::cerr << "Connections were constructed " << constructed << " times\n";
+      return 1;
+    }
+
+    std::cout << "1000 connection uses, " << constructed << " constructions\n";
+  }
+
+  if (destructed != constructed) {
+    std::cerr << destructed << " of " << constructed << " connections were destructed\n";
+    return 1;
+  }
+
+  gcFree();
+
+  return 0;
+}
@@ -0,0 +1,40 @@
+#include <iostream>
+#include "../garbage-collector/cppGarbageCollector.h"
+
+struct Parent : public Traceable {
+    Traceable* children[8];
+    uint8_t payload[256];
+};
+
+struct Child : public Traceable {
+    uint64_t value;
+};
+
+struct Table : public Traceable {
+    uint8_t data[1024 * 1024];
+};
+
+int main() {
+  gcInit(1024 * 1024 * 100);
+
+  // Parent on node 0, its children next to it
+  Parent* parent = new (OnNode{0}) Parent();
+  for (int i = 0; i < 8; ++i) {
+    parent->children[i] = new (Near{parent}) Child();
+    if (parent->children[i]->node() != parent->node()) {
+      std::cerr << "Child " << i << " was not placed next to its parent\n";
+      return 1;
+    }
+  }
+
+  // A big shared table spread over all nodes
+  Table* table = new (interleaved) Table();
+  for (size_t i = 0; i < sizeof(table->data); i += 4096) table->data[i] = (uint8_t)i;
+
+  std::cout << "Parent on node " << parent->node() << ", table page 0 on node " << table->node() << "\n";
+
+  gc();
+  gcFree();
+
+  return 0;
+}
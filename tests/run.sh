@@ -7,6 +7,7 @@ set -euo pipefail
 USE_VALGRIND=false
 USE_DEBUG=false
 EVAL_ONLY=false
+BENCH_ONLY=false
 
 print_usage() {
     echo "Usage: $0 [OPTIONS]"
@@ -15,6 +16,7 @@ print_usage() {
     echo "  -v       Run tests under Valgrind"
     echo "  -d       Run 'make debug' instead of 'make'"
     echo "  -eval    Show evaluation results for the allocator"
+    echo "  -bench   Run the benchmark suite, write bench.csv and locality.csv"
     echo "  -h       Show this help message and exit"
     echo ""
     echo "Examples:"
@@ -23,6 +25,7 @@ print_usage() {
     echo "  $0 -v        Run tests with Valgrind"
     echo "  $0 -d -v     Run make debug and test with Valgrind"
     echo "  $0 -eval       Compile and compare NUMA vs malloc results"
+    echo "  $0 -bench      Benchmark NUMA allocation against malloc"
 }
 
 # Parse flags
@@ -31,6 +34,7 @@ for arg in "$@"; do
         -v) USE_VALGRIND=true ;;
         -d) USE_DEBUG=true ;;
         -eval) EVAL_ONLY=true ;;
+        -bench) BENCH_ONLY=true ;;
         -h) print_usage; exit 0 ;;
         *) echo "Unknown option: $arg"; print_usage; exit 1 ;;
     esac
@@ -48,17 +52,17 @@ if $EVAL_ONLY; then
     make numa_alloc 
 
     # Compile with NUMA local allocations
-    gcc -D_GNU_SOURCE -DNUMA_ALLOC -Wall -DLOCAL -Wextra -O2 eval_allocator.c allocator.o numa.o util.o -o eval_allocator_numa -pthread -lm
+    gcc -D_GNU_SOURCE -DNUMA_ALLOC -Wall -DLOCAL -Wextra -O2 eval_allocator.c allocator.o numa.o util.o pagemap.o -o eval_allocator_numa -pthread -lm
 
     # Compile with NUMA interleaved allocations
-    gcc -D_GNU_SOURCE -DNUMA_ALLOC -DINTERLEAVED -Wall -Wextra -O2 eval_allocator.c allocator.o numa.o util.o -o eval_allocator_numa_int -pthread -lm
+    gcc -D_GNU_SOURCE -DNUMA_ALLOC -DINTERLEAVED -Wall -Wextra -O2 eval_allocator.c allocator.o numa.o util.o pagemap.o -o eval_allocator_numa_int -pthread -lm
 
     # Compile with malloc
-    gcc -D_GNU_SOURCE -Wall -Wextra -O2 eval_allocator.c allocator.o numa.o util.o -o eval_allocator -pthread -lm
+    gcc -D_GNU_SOURCE -Wall -Wextra -O2 eval_allocator.c allocator.o numa.o util.o pagemap.o -o eval_allocator -pthread -lm
 
-    gcc -o eval_mixed eval_allocator_mixed.c allocator.o numa.o util.o -pthread -lm
-    gcc -DNUMA_ALLOC -DLOCAL -o eval_mixed_local eval_allocator_mixed.c allocator.o numa.o util.o -pthread -lm
-    gcc -DNUMA_ALLOC -DINTERLEAVED -o eval_mixed_int eval_allocator_mixed.c allocator.o numa.o util.o -pthread -lm
+    gcc -o eval_mixed eval_allocator_mixed.c allocator.o numa.o util.o pagemap.o -pthread -lm
+    gcc -DNUMA_ALLOC -DLOCAL -o eval_mixed_local eval_allocator_mixed.c allocator.o numa.o util.o pagemap.o -pthread -lm
+    gcc -DNUMA_ALLOC -DINTERLEAVED -o eval_mixed_int eval_allocator_mixed.c allocator.o numa.o util.o pagemap.o -pthread -lm
 
     # Run and capture results
     ./eval_allocator_numa > numa_eval.txt
@@ -90,6 +94,16 @@ if $EVAL_ONLY; then
     }
 fi
 
+if $BENCH_ONLY; then
+    echo "[INFO] Running allocator benchmarks..."
+
+    make bench_allocator bench_locality
+    ./bench_allocator | tee bench.csv
+    ./bench_locality | tee locality.csv
+
+    exit 0
+fi
+
 # Choose make target
 if $USE_DEBUG; then
     echo "Running: make debug"
@@ -100,10 +114,10 @@ else
 fi
 
 # Array of test sources (without extensions)
-tests=("hash" "simple" "randomAllocations" "vectors")
+tests=("hash" "simple" "randomAllocations" "vectors" "largeObjects" "placement" "objectPool" "containers")
 
 # Object file dependencies (adjust paths if needed)
-OBJS="numa.o util.o allocator.o cppGarbageCollector.o"
+OBJS="numa.o util.o allocator.o pagemap.o cppGarbageCollector.o"
 
 # Compiler and flags
 CXX=g++
@@ -127,3 +141,29 @@ for test in "${tests[@]}"; do
     rm "$test"
 done
 
+# The multi-node paths run on an emulated topology, so single node machines cover them too
+echo "Compiling emulation_test.c..."
+make emulation_test
+
+echo "Running emulation_test on 4 emulated nodes..."
+if $USE_VALGRIND; then
+    NUMA_EMULATE_NODES=4 valgrind --leak-check=full --show-leak-kinds=all ./emulation_test
+else
+    NUMA_EMULATE_NODES=4 ./emulation_test
+fi
+
+echo "--------------------------------------------"
+
+rm emulation_test
+
+# The malloc shim is checked from a plain C program loaded in front of glibc, valgrind
+# would replace malloc itself
+echo "Compiling shim_test.c..."
+make shim_test
+
+echo "Running shim_test..."
+LD_PRELOAD=./libnumaalloc.so ./shim_test
+
+echo "--------------------------------------------"
+
+rm shim_test
@@ -0,0 +1,160 @@
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Checks the malloc shim from an unmodified program, run as
+ * LD_PRELOAD=./libnumaalloc.so ./shim_test: alignment, calloc and realloc contracts,
+ * threads churning at once, and a fork while they do.
+ */
+
+#define THREADS 4
+#define ROUNDS 200
+#define SLOTS 256
+#define FORKS 100
+
+static int failed;
+static volatile int churning = 1;
+
+#define CHECK(condition, ...) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            failed = 1; \
+        } \
+    } while (0)
+
+static void check_alignment(void) {
+    for (size_t alignment = 16; alignment <= 16384; alignment *= 2) {
+        for (size_t size = 1; size <= 100000; size *= 7) {
+            void *ptr = NULL;
+
+            CHECK(posix_memalign(&ptr, alignment, size) == 0, "posix_memalign(%zu, %zu) failed", alignment, size);
+            CHECK((uintptr_t) ptr % alignment == 0, "posix_memalign(%zu, %zu) gave %p", alignment, size, ptr);
+            memset(ptr, 1, size);
+            free(ptr);
+
+            ptr = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+            CHECK(ptr != NULL && (uintptr_t) ptr % alignment == 0, "aligned_alloc(%zu) gave %p", alignment, ptr);
+            free(ptr);
+        }
+    }
+}
+
+static void check_calloc(void) {
+    // Dirty the blocks first, calloc must zero recycled memory
+    for (size_t size = 8; size <= (1 << 20); size *= 4) {
+        char *dirty = malloc(size);
+        memset(dirty, 0xff, size);
+        free(dirty);
+
+        unsigned char *zeroed = calloc(size, 1);
+        CHECK(zeroed != NULL, "calloc(%zu) failed", size);
+        for (size_t i = 0U; zeroed != NULL && i < size; i++) {
+            if (zeroed[i] != 0) {
+                CHECK(0, "calloc(%zu) byte %zu is %d", size, i, zeroed[i]);
+                break;
+            }
+        }
+        free(zeroed);
+    }
+
+    volatile size_t count = SIZE_MAX / 2;
+    CHECK(calloc(count, 4) == NULL, "calloc overflow was not caught");
+}
+
+static void check_realloc(void) {
+    unsigned char *ptr = NULL;
+    size_t size = 0U;
+
+    // Grow through the bins into large objects and shrink back, keeping the content
+    for (size_t next = 3; next <= (1 << 21); next = next * 3 + 1) {
+        ptr = realloc(ptr, next);
+        CHECK(ptr != NULL, "realloc to %zu failed", next);
+        for (size_t i = 0U; i < size; i++) {
+            if (ptr[i] != (unsigned char) i) {
+                CHECK(0, "realloc to %zu lost byte %zu", next, i);
+                break;
+            }
+        }
+        for (size_t i = size; i < next; i++) ptr[i] = (unsigned char) i;
+        CHECK(malloc_usable_size(ptr) >= next, "usable size %zu below %zu", malloc_usable_size(ptr), next);
+        size = next;
+    }
+
+    ptr = realloc(ptr, 10);
+    for (size_t i = 0U; i < 10; i++) CHECK(ptr[i] == (unsigned char) i, "shrinking realloc lost byte %zu", i);
+    free(ptr);
+}
+
+static void *churn(void *arg) {
+    unsigned seed = (unsigned) (uintptr_t) arg;
+    void *slots[SLOTS] = { NULL };
+
+    for (int round = 0; round < ROUNDS || churning; round++) {
+        for (size_t i = 0U; i < SLOTS; i++) {
+            size_t size = (size_t) rand_r(&seed) % (rand_r(&seed) % 8 ? 512 : 200000) + 1;
+
+            free(slots[i]);
+            slots[i] = malloc(size);
+            memset(slots[i], (int) i, size < 64 ? size : 64);
+        }
+        if (round >= ROUNDS) churning = 0;
+    }
+
+    for (size_t i = 0U; i < SLOTS; i++) free(slots[i]);
+    return NULL;
+}
+
+// Forks while the other threads churn, the child has to be able to allocate
+static void check_fork(void) {
+    for (int i = 0; i < FORKS; i++) {
+        pid_t child = fork();
+
+        if (child == 0) {
+            // Enough sizes to need every bin's shared spans and the page heap
+            alarm(10);
+            for (size_t size = 16; size <= (1 << 20); size *= 2) {
+                void *ptrs[64];
+                for (size_t j = 0U; j < 64; j++) ptrs[j] = malloc(size);
+                for (size_t j = 0U; j < 64; j++) free(ptrs[j]);
+            }
+            _exit(0);
+        }
+
+        int status = 0;
+        waitpid(child, &status, 0);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0, "child %d did not exit cleanly", i);
+    }
+}
+
+int main(void) {
+    int (*node_of)(const void *) = (int (*)(const void *)) dlsym(RTLD_DEFAULT, "node_of");
+    void *probe = malloc(64);
+
+    if (node_of == NULL || node_of(probe) == -1) {
+        fprintf(stderr, "Run with LD_PRELOAD=./libnumaalloc.so\n");
+        return 1;
+    }
+    free(probe);
+
+    check_alignment();
+    check_calloc();
+    check_realloc();
+
+    pthread_t threads[THREADS];
+    for (uintptr_t i = 0U; i < THREADS; i++) pthread_create(&threads[i], NULL, churn, (void *) (i + 1));
+    check_fork();
+    churning = 0;
+    for (size_t i = 0U; i < THREADS; i++) pthread_join(threads[i], NULL);
+
+    printf(failed ? "shim test failed\n" : "shim test passed\n");
+    return failed;
+}